@@ -4,10 +4,12 @@
 /* Mandelbrot Set and Julia Sets.                    */
  
 /* There are no dependencies.  To compile on linux,  */
-/* try: gcc fractals.cpp -o fractals                 */
+/* try: gcc fractals.cpp -pthread -o fractals        */
 
 /* Using Visual C++ in Windows, the following        */
 /* worked from a command prompt: cl fractals.cpp     */
+/* (The daemon mode needs POSIX sockets and threads  */
+/* and is not available in the Windows build.)       */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,11 +17,39 @@
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <fcntl.h>
 #include <io.h>
+#include <direct.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#define HAVE_PTHREADS 1
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#define HAVE_MMAP 1
 #endif
 
 #include <math.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+
+// Never fuse a * b + c into a single rounding, so that the iteration counts come out the
+// same whether or not the compiler targets a CPU with fused multiply-add.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract (off)
+#endif
 
 struct pixel
 {
@@ -28,14 +58,162 @@ struct pixel
     unsigned char   blue;
 };
 
+// The user supplied settings, before defaults are applied.
+struct options
+{
+  char*     userfilename;
+  char*     daemonpath;      // -d: serve requests on this socket
+  char*     clientpath;      // -D: send the request to the daemon on this socket
+  int       showhelp;
+  int       showversion;
+  int       user_capk;
+  double    user_centerx;
+  double    user_centery;
+  int       user_centeroverride;
+  double    user_julia_r;
+  double    user_julia_i;
+  int       MakeJuliaSet;
+  long      user_resolx;
+  long      user_resoly;
+  int       user_resolutionoverride;
+  double    user_zoomlevel;
+  int       user_priority;
+  int       user_threads;
+  int       user_pyramidlevels;  // -T: render a tile pyramid down to this level
+  double    user_julia2_r;       // -J: c of the last Julia set in a sweep
+  double    user_julia2_i;
+  int       MakeJuliaSweep;
+  long      user_sweepcols;      // -g: grid of Julia sets in a sweep
+  long      user_sweeprows;
+  char*     sweepdir;            // -O: write each Julia set of a sweep to its own file here
+  int       user_sweeppolicy;    // -s: what to do with disconnected Julia sets in a sweep
+  char*     formatname;          // -f: ppm, png or qoi
+  char*     palettename;         // -p: a built in palette or a gradient file
+  int       equalize;            // --equalize: color by the rank of each k
+  int       resume;              // --resume: carry on from the checkpoint of an earlier run
+  int       user_shard;          // --shard i/N: render only the i-th of N interleaved sets of tiles
+  int       user_shards;
+  int       merge;               // --merge: assemble the shard files named on the command line
+  int       adaptive;            // --adaptive: raise the cap only where it still makes a difference
+  int       saveorbits;          // --save-orbits: keep the orbits of the pixels that reached the cap
+  int       user_continueto;     // --continue-to: carry on with those orbits up to this cap
+  int       deterministic;       // --deterministic: the same bits on every machine
+  int       selftest;            // --selftest: render the reference scenes and check them
+  int       borderfill;          // --border-fill: fill pyramid tiles deep inside the set from their border
+  char**    inputfiles;          // the arguments that are not options
+  int       inputcount;
+};
+
+// Everything needed to compute the iteration count of any pixel in the image.
+struct view
+{
+  int       MakeJuliaSet;
+  double    c_r;
+  double    c_i;
+  double    centerx;
+  double    centery;
+  double    zoomlevel;
+  long      resolx;
+  long      resoly;
+  int       capk;
+  double    pixelwidth;
+  double    xminplushalf;
+  double    ymaxlesshalf;
+  int       hasattractor;      // Julia Sets: orbits that reach the disc
+  double    attractor_r;       // around this point never escape
+  double    attractor_i;
+  double    attractorradius2;
+  int       deterministic;     // no attractor shortcut, which depends on the math library
+};
+
+// A cycle of colors for the points that escape, and the color of the points in the set.
+struct palette
+{
+  struct pixel*   cycle;
+  int             period;
+  struct pixel    inside;
+};
+
+// A palette laid out for one cap: the color of every k from 0 to capk.
+struct colormap
+{
+  struct pixel*   lut;
+  int             capk;
+  int             period;    // 0 if lut has every k, else lut has one cycle and then the inside
+};
+
+struct renderrows
+{
+  const struct view*      v;
+  const struct colormap*  cm;
+};
+
 void printusage();
 int Get2Tuple( char*, double*, double* );
 int Get2Tuple( char*, long*, long* );
 void initpal(struct pixel *);
+void ParseOptions( int, char**, struct options* );
+void FreeOptions( struct options* );
+void SetupView( const struct options*, struct view* );
+int IteratePixel( const struct view*, long, long );
+void StartPixel( const struct view*, long, long, double* );
+int ContinuePixel( const struct view*, long, long, int, int, double* );
+void SetJuliaConstant( struct view*, double, double );
+void RenderTile( const struct view*, long, long, long, long, int* );
+void ColorPixels( const int*, long, const struct colormap*, struct pixel* );
+int LoadPalette( const char*, int, struct palette* );
+void FreePalette( struct palette* );
+int OptionPalette( const struct options*, struct palette* );
+int MakeColorMap( const struct palette*, int, struct colormap* );
+int MakeEqualizedColorMap( const struct palette*, int, const long long*, struct colormap* );
+void FreeColorMap( struct colormap* );
+void RenderRows( void*, long, long, struct pixel* );
+int ImageFormat( const char*, const char* );
+const char* ImageExtension( int );
+int WriteImageBands( FILE*, int, long, long, int, void (*)( void*, long, long, struct pixel* ), void* );
+int RenderMappedPPM( FILE*, const struct view*, const struct colormap*, int, const char*, int, int, int );
+int RunMerge( const struct options*, int, FILE*, int );
+int RenderEqualized( const struct view*, const struct palette*, int, FILE*, int, const char* );
+struct orbitstate;
+int RenderOrbits( const struct view*, int, int, const struct palette*, int, int, FILE*, int, const char* );
+int WriteOrbits( const char*, const struct orbitstate*, long, int );
+int RunContinue( const struct options*, int );
+void DescribeView( const struct view*, char*, int );
+int DefaultThreadCount();
+void RunWorkers( int, void* (*)( void* ), void* );
+long AtomicAdd( long*, long );
+long NextWorkItem( long* );
+double WallSeconds();
+int MakeDir( const char* );
+int RunDaemon( const char*, int );
+int RunClient( const char*, int, char**, FILE* );
+int RunPyramid( const struct options*, int, int );
+int RunSweep( const struct options*, int, FILE*, int, const struct palette* );
+int RunSelfTest( int );
+
+#define SWEEPTHUMBX  160  // default Julia Set sweep thumbnail size
+#define SWEEPTHUMBY  120
+
+#define TILESIZE     64   // tile size of the daemon and memory mapped renders, and of orbit buffers
+
+#define CHECKPOINTSECONDS  60  // how often a memory mapped render records its finished tiles
+
+#define ADAPTIVESTARTCAP   256      // --adaptive caps
+#define ADAPTIVEMAXCAP     1000000  // the highest it goes to when there is no -m
+
+#define IMAGEPPM     0    // output formats
+#define IMAGEPNG     1
+#define IMAGEQOI     2
+
+#define SWEEPFULL    0    // -s policies for disconnected Julia Sets in a sweep
+#define SWEEPCOARSE  1
+#define SWEEPSKIP    2
 
 const char* VersionStr = "1.0.1";
 const unsigned char CRLF[2] = {0x0D,0x0A};
 
+const double m  = 100.0;  // min norm to be considered an escapee
+
 int main( int argc, char* argv[] ) {
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
@@ -45,18 +223,222 @@ int main( int argc, char* argv[] ) {
  }
 #endif
 
-  char*     userfilename = NULL;
-  int       user_capk    = -1;
-  double    user_centerx = 0.0;
-  double    user_centery = 0.0;
-  int       user_centeroverride = 0;
-  double    user_julia_r = 0.0;
-  double    user_julia_i = 0.0;
-  int       MakeJuliaSet = 0;
-  long      user_resolx = 0.0;
-  long      user_resoly = 0.0;
-  int       user_resolutionoverride = 0;
-  double    user_zoomlevel = -1.0;
+  struct options opt;
+  ParseOptions( argc, argv, &opt );
+
+  if ( opt.showhelp ) {
+    printusage();
+    return 0;
+  }
+
+  if ( opt.showversion ) {
+    printf( "fractals version %s\n", VersionStr );
+    return 0;
+  }
+
+  char* userfilename = opt.userfilename;
+  int format = ImageFormat( opt.formatname, userfilename );
+  int threads = opt.user_threads > 0 ? opt.user_threads : DefaultThreadCount();
+
+  if ( opt.selftest ) {
+    int retval = RunSelfTest( threads );
+    FreeOptions( &opt );
+    return retval;
+  }
+
+  if ( opt.user_pyramidlevels >= 0 ) {
+    int retval = RunPyramid( &opt, opt.user_pyramidlevels, threads );
+    FreeOptions( &opt );
+    return retval;
+  }
+
+  if ( opt.daemonpath != NULL ) {
+    int retval = RunDaemon( opt.daemonpath, threads );
+    FreeOptions( &opt );
+    return retval;
+  }
+
+  if ( opt.user_continueto > 0 ) {
+    int retval = RunContinue( &opt, threads );
+    FreeOptions( &opt );
+    return retval;
+  }
+
+  struct palette pal;
+  if ( OptionPalette( &opt, &pal ) != 0 ) {
+    FreeOptions( &opt );
+    return -1;
+  }
+
+  // a plain render to a PPM file keeps a checkpoint next to it, for --resume
+  char* checkpointpath = NULL;
+  int resuming = 0;
+  if ( userfilename != NULL && ( format == IMAGEPPM || opt.user_shards > 0 ) && opt.clientpath == NULL
+       && !opt.MakeJuliaSweep && !opt.merge && !opt.adaptive && !opt.saveorbits && !opt.equalize ) {
+    checkpointpath = (char*) malloc( strlen( userfilename ) + 6 );
+    if ( checkpointpath != NULL ) {
+      sprintf( checkpointpath, "%s.ckpt", userfilename );
+      FILE* fdtest = opt.resume ? fopen( checkpointpath, "rb" ) : NULL;
+      if ( fdtest != NULL ) {
+        resuming = 1;
+        fclose( fdtest );
+      }
+    }
+  }
+
+  FILE* fpout = stdout;
+  if ( resuming ) {
+    fpout = fopen( userfilename, "r+b" );
+    if ( fpout == NULL ) {
+      printf("Error: Could not open file \"%s\" to resume.  Exiting.\n\n", userfilename );
+      free( checkpointpath );
+      FreePalette( &pal );
+      FreeOptions( &opt );
+      return -1;
+    }
+  }
+  else if ( userfilename != NULL ) {
+    FILE* fdtest = fopen( userfilename, "r" );
+    if ( fdtest != NULL ) {
+      printf("Output file \"%s\" already exists.  Refusing to overwrite.  Exiting.\n\n", userfilename );
+      fclose( fdtest );
+      free( checkpointpath );
+      FreePalette( &pal );
+      FreeOptions( &opt );
+      return -1;
+    }
+    fpout = fopen( userfilename, "w+b" );  // read too, so it can be memory mapped
+    if ( fpout == NULL ) {
+      printf("Error: Could not open file \"%s\" for write.  Exiting.\n\n", userfilename );
+      free( checkpointpath );
+      FreePalette( &pal );
+      FreeOptions( &opt );
+      return -1;
+    }
+  }
+
+  int retval = 0;
+  if ( opt.clientpath != NULL )
+    retval = RunClient( opt.clientpath, argc, argv, fpout );
+  else if ( opt.MakeJuliaSweep ) {
+    // with -O and no -o, there is no contact sheet
+    int wantsheet = opt.sweepdir == NULL || userfilename != NULL;
+    retval = RunSweep( &opt, threads, wantsheet ? fpout : NULL, format, &pal );
+  }
+  else if ( opt.merge )
+    retval = RunMerge( &opt, threads, fpout, format );
+  else if ( opt.user_shards > 0 ) {
+    struct view v;
+    SetupView( &opt, &v );
+
+    struct colormap cm;
+    int mapped = MakeColorMap( &pal, v.capk, &cm );
+    if ( opt.adaptive || opt.saveorbits || opt.equalize ) {
+      fprintf( stderr, "Error: A shard can't be adaptive, equalized or have its orbits saved.\n" );
+      retval = -1;
+    }
+    // a shard file is always rendered into in place
+    else if ( mapped == 0 ) {
+      mapped = 1;
+      if ( fpout != stdout )
+        mapped = RenderMappedPPM( fpout, &v, &cm, threads, checkpointpath, resuming, opt.user_shard, opt.user_shards );
+      if ( mapped != 0 ) {
+        fprintf( stderr, "Error: Could not write the shard.  It needs -o and a regular file.\n" );
+        retval = -1;
+      }
+      FreeColorMap( &cm );
+    }
+    else
+      retval = -1;
+  }
+  else if ( opt.equalize && !opt.adaptive && !opt.saveorbits ) {
+    struct view v;
+    SetupView( &opt, &v );
+
+    // with -o, the iteration counts wait next to the image between the two passes
+    char* spillpath = NULL;
+    if ( userfilename != NULL ) {
+      spillpath = (char*) malloc( strlen( userfilename ) + 7 );
+      if ( spillpath != NULL )
+        sprintf( spillpath, "%s.spill", userfilename );
+    }
+    retval = RenderEqualized( &v, &pal, threads, fpout, format, spillpath );
+    free( spillpath );
+  }
+  else if ( opt.adaptive || opt.saveorbits ) {
+    struct view v;
+    SetupView( &opt, &v );
+
+    // the orbits are saved next to the image
+    char* orbitspath = NULL;
+    if ( opt.saveorbits && userfilename != NULL ) {
+      orbitspath = (char*) malloc( strlen( userfilename ) + 8 );
+      if ( orbitspath != NULL )
+        sprintf( orbitspath, "%s.orbits", userfilename );
+    }
+
+    if ( opt.saveorbits && orbitspath == NULL ) {
+      fprintf( stderr, "Error: --save-orbits needs -o.\n" );
+      retval = -1;
+    }
+    else
+      retval = RenderOrbits( &v, opt.adaptive, opt.user_capk > 0 || !opt.adaptive ? v.capk : ADAPTIVEMAXCAP,
+                             &pal, opt.equalize, threads, fpout, format, orbitspath );
+    free( orbitspath );
+  }
+  else {
+    struct view v;
+    SetupView( &opt, &v );
+
+    struct colormap cm;
+    int mapped = MakeColorMap( &pal, v.capk, &cm );
+
+    // a PPM file can be rendered into in place
+    if ( mapped == 0 ) {
+      mapped = 1;
+      if ( format == IMAGEPPM && fpout != stdout )
+        mapped = RenderMappedPPM( fpout, &v, &cm, threads, checkpointpath, resuming, 0, 0 );
+
+      // a partly written file can only be carried on with in place
+      if ( mapped == 1 && resuming )
+        mapped = -1;
+
+      struct renderrows rr = { &v, &cm };
+      if ( mapped == 1 )
+        mapped = WriteImageBands( fpout, format, v.resolx, v.resoly, threads, RenderRows, &rr );
+      FreeColorMap( &cm );
+    }
+
+    if ( mapped != 0 ) {
+      fprintf( stderr, "Error: Could not write the image.\n" );
+      retval = -1;
+    }
+  }
+
+  if ( fpout != stdout ) {
+    fclose(fpout);
+    fpout = NULL;
+
+    // a failed request to the daemon or merge leaves no empty or half written file behind
+    if ( retval != 0 && ( opt.clientpath != NULL || opt.merge ) )
+      remove( userfilename );
+  }
+
+  free( checkpointpath );
+  FreePalette( &pal );
+  FreeOptions( &opt );
+  userfilename = NULL;
+
+  return retval;
+}
+
+// Parse the command line (or a daemon request line) into *opt.
+void ParseOptions( int argc, char* argv[], struct options* opt ) {
+
+  memset( opt, 0, sizeof(struct options) );
+  opt->user_capk      = -1;
+  opt->user_zoomlevel = -1.0;
+  opt->user_pyramidlevels = -1;
 
   long i;
   for ( i = 1; i < argc; ) {
@@ -68,70 +450,169 @@ int main( int argc, char* argv[] ) {
     if ( ishyphen && len > 1 )
       argsprocessed = 1;
 
+    // long options: --name, --name=value or --name value
+    if ( argsprocessed >= 1 && argv[i][1] == '-' ) {
+      const char* name = &argv[i][2];
+      const char* equals = strchr( name, '=' );
+      long namelen = equals != NULL ? equals - name : (long) strlen( name );
+      const char* optionvalue = equals != NULL ? equals + 1 : NULL;
+      int nextisvalue = optionvalue == NULL && nextlen > 0;
+      if ( nextisvalue )
+        optionvalue = argv[i+1];
+
+      if ( namelen == 6 && strncmp( name, "resume", 6 ) == 0 )
+        opt->resume = 1;
+      else if ( namelen == 5 && strncmp( name, "merge", 5 ) == 0 )
+        opt->merge = 1;
+      else if ( namelen == 8 && strncmp( name, "adaptive", 8 ) == 0 )
+        opt->adaptive = 1;
+      else if ( namelen == 8 && strncmp( name, "equalize", 8 ) == 0 )
+        opt->equalize = 1;
+      else if ( namelen == 13 && strncmp( name, "deterministic", 13 ) == 0 )
+        opt->deterministic = 1;
+      else if ( namelen == 8 && strncmp( name, "selftest", 8 ) == 0 )
+        opt->selftest = 1;
+      else if ( namelen == 11 && strncmp( name, "border-fill", 11 ) == 0 )
+        opt->borderfill = 1;
+      else if ( namelen == 11 && strncmp( name, "save-orbits", 11 ) == 0 )
+        opt->saveorbits = 1;
+      else if ( namelen == 11 && strncmp( name, "continue-to", 11 ) == 0 ) {
+        if ( optionvalue != NULL )
+          opt->user_continueto = abs(atoi( optionvalue ));
+        if ( nextisvalue )
+          argsprocessed = 2;
+      }
+      else if ( namelen == 5 && strncmp( name, "shard", 5 ) == 0 ) {  // i/N
+        int shard, shards;
+        if ( optionvalue != NULL && sscanf( optionvalue, "%d/%d", &shard, &shards ) == 2
+             && shard >= 0 && shard < shards ) {
+          opt->user_shard = shard;
+          opt->user_shards = shards;
+        }
+        if ( nextisvalue )
+          argsprocessed = 2;
+      }
+
+      i += argsprocessed;
+      continue;
+    }
+
+    // anything else that isn't an option is an input file
+    if ( argsprocessed == 0 ) {
+      char** grown = (char**) realloc( opt->inputfiles, sizeof(char*) * ( opt->inputcount + 1 ) );
+      if ( grown != NULL ) {
+        opt->inputfiles = grown;
+        opt->inputfiles[opt->inputcount++] = strdup( argv[i] );
+      }
+    }
+
     if ( argsprocessed >= 1 ) {
       char useroption = argv[i][1];
       char* optionvalue = NULL;
       if ( len >= 3 )
         optionvalue = &argv[i][2];
 
+      // every option except -h and -v takes a value
+      if ( useroption != 'h' && useroption != 'v' && optionvalue == NULL && nextlen > 0 ) {
+        optionvalue = argv[i+1];
+        argsprocessed = 2;
+      }
+
       switch ( useroption ) {
        case 'c':  // center point  (x,y)
-        if ( optionvalue == NULL && nextlen > 0 ) {
-          optionvalue = argv[i+1];
-          argsprocessed = 2;
+        if ( optionvalue != NULL )
+          opt->user_centeroverride = !Get2Tuple( optionvalue, &opt->user_centerx, &opt->user_centery );
+        break;
+       case 'd':  // run as a daemon listening on this socket
+        if ( optionvalue != NULL ) {
+          free( opt->daemonpath );
+          opt->daemonpath = strdup( optionvalue );
+        }
+        break;
+       case 'D':  // hand the render to the daemon listening on this socket
+        if ( optionvalue != NULL ) {
+          free( opt->clientpath );
+          opt->clientpath = strdup( optionvalue );
+        }
+        break;
+       case 'f':  // output image format
+        if ( optionvalue != NULL ) {
+          free( opt->formatname );
+          opt->formatname = strdup( optionvalue );
         }
+        break;
+       case 'g':  // grid size of a Julia set sweep
         if ( optionvalue != NULL )
-          user_centeroverride = !Get2Tuple( optionvalue, &user_centerx, &user_centery );
+          Get2Tuple( optionvalue, &opt->user_sweepcols, &opt->user_sweeprows );
         break;
        case 'h':
-        printusage();
-        return 0;
-        break;
+        opt->showhelp = 1;
+        return;
        case 'j':  // julia set constant value (the real part and imaginary part)
-        if ( optionvalue == NULL && nextlen > 0 ) {
-          optionvalue = argv[i+1];
-          argsprocessed = 2;
-        }
         if ( optionvalue != NULL )
-          MakeJuliaSet = !Get2Tuple( optionvalue, &user_julia_r, &user_julia_i );
+          opt->MakeJuliaSet = !Get2Tuple( optionvalue, &opt->user_julia_r, &opt->user_julia_i );
+        break;
+       case 'J':  // sweep Julia sets from the -j constant to this one
+        if ( optionvalue != NULL )
+          opt->MakeJuliaSweep = !Get2Tuple( optionvalue, &opt->user_julia2_r, &opt->user_julia2_i );
         break;
        case 'm':  // maximum number of iterations per pixel
-        if ( optionvalue == NULL && nextlen > 0 ) {
-          optionvalue = argv[i+1];
-          argsprocessed = 2;
-        }
         if ( optionvalue != NULL )
-          user_capk = abs(atoi( optionvalue ));
+          opt->user_capk = abs(atoi( optionvalue ));
         break;
        case 'o':  // output file name
-        if ( optionvalue == NULL && nextlen > 0 ) {
-          optionvalue = argv[i+1];
-          argsprocessed = 2;
+        if ( optionvalue != NULL ) {
+          free( opt->userfilename );
+          opt->userfilename = strdup( optionvalue );
+        }
+        break;
+       case 'O':  // directory for the separate images of a sweep
+        if ( optionvalue != NULL ) {
+          free( opt->sweepdir );
+          opt->sweepdir = strdup( optionvalue );
+        }
+        break;
+       case 'p':  // palette
+        if ( optionvalue != NULL ) {
+          free( opt->palettename );
+          opt->palettename = strdup( optionvalue );
         }
+        break;
+       case 'P':  // daemon scheduling priority
         if ( optionvalue != NULL )
-          userfilename = strdup( optionvalue );
+          opt->user_priority = atoi( optionvalue );
         break;
        case 'r':  // image resolution
-        if ( optionvalue == NULL && nextlen > 0 ) {
-          optionvalue = argv[i+1];
-          argsprocessed = 2;
+        if ( optionvalue != NULL )
+          opt->user_resolutionoverride = !Get2Tuple( optionvalue, &opt->user_resolx, &opt->user_resoly );
+        break;
+       case 'T':  // tile pyramid down to this level
+        if ( optionvalue != NULL )
+          opt->user_pyramidlevels = abs(atoi( optionvalue ));
+        break;
+       case 's':  // sweep policy for disconnected Julia sets
+        if ( optionvalue != NULL ) {
+          if ( strcmp( optionvalue, "coarse" ) == 0 )
+            opt->user_sweeppolicy = SWEEPCOARSE;
+          else if ( strcmp( optionvalue, "skip" ) == 0 )
+            opt->user_sweeppolicy = SWEEPSKIP;
+          else
+            opt->user_sweeppolicy = SWEEPFULL;
         }
+        break;
+       case 't':  // number of worker threads
         if ( optionvalue != NULL )
-          user_resolutionoverride = !Get2Tuple( optionvalue, &user_resolx, &user_resoly );
+          opt->user_threads = abs(atoi( optionvalue ));
         break;
        case 'v':
-        printf( "fractals version %s\n", VersionStr );
-        return 0;
-        break;
+        opt->showversion = 1;
+        return;
        case 'z':
-        if ( optionvalue == NULL && nextlen > 0 ) {
-          optionvalue = argv[i+1];
-          argsprocessed = 2;
-        }
         if ( optionvalue != NULL )
-          user_zoomlevel = fabs(atof( optionvalue ));
+          opt->user_zoomlevel = fabs(atof( optionvalue ));
         break;
        default:
+        argsprocessed = 1;
         break;
       }
     }
@@ -141,298 +622,4268 @@ int main( int argc, char* argv[] ) {
     else
       i++;
   }
+}
 
-  double centerx = 0.0;
-  double centery = 0.0;
-  if ( !MakeJuliaSet )  // ie. Make the Mandelbrot Set
-    centerx = -0.75;
-  if ( user_centeroverride ) {
-    centerx = user_centerx;
-    centery = user_centery;
+void FreeOptions( struct options* opt ) {
+
+  free( opt->userfilename );
+  free( opt->daemonpath );
+  free( opt->clientpath );
+  free( opt->sweepdir );
+  free( opt->formatname );
+  free( opt->palettename );
+  opt->userfilename = opt->daemonpath = opt->clientpath = opt->sweepdir = opt->formatname = opt->palettename = NULL;
+
+  int i;
+  for ( i = 0; i < opt->inputcount; i++ )
+    free( opt->inputfiles[i] );
+  free( opt->inputfiles );
+  opt->inputfiles = NULL;
+  opt->inputcount = 0;
+}
+
+// Apply the defaults and work out the pixel geometry.
+void SetupView( const struct options* opt, struct view* v ) {
+
+  v->MakeJuliaSet = opt->MakeJuliaSet;
+
+  v->centerx = 0.0;
+  v->centery = 0.0;
+  if ( !v->MakeJuliaSet )  // ie. Make the Mandelbrot Set
+    v->centerx = -0.75;
+  if ( opt->user_centeroverride ) {
+    v->centerx = opt->user_centerx;
+    v->centery = opt->user_centery;
   }
 
-  double c_r = 0.0;
-  double c_i = 0.0;
-  if ( MakeJuliaSet ) {
-    c_r = user_julia_r;
-    c_i = user_julia_i;
+  v->c_r = 0.0;
+  v->c_i = 0.0;
+  v->deterministic = opt->deterministic;
+  if ( v->MakeJuliaSet )
+    SetJuliaConstant( v, opt->user_julia_r, opt->user_julia_i );
+  else
+    v->hasattractor = 0;
+
+  v->capk = 2048;
+  if ( opt->user_capk > 0 && opt->user_capk < 10000000 )
+    v->capk = opt->user_capk;
+
+  v->resolx = 1024;  // horizontal resolution in pixels
+  v->resoly = 768;   // vertical resolution in pixels
+  if ( opt->user_resolutionoverride ) {
+    v->resolx = opt->user_resolx;
+    v->resoly = opt->user_resoly;
   }
 
-  int capk = 2048;
-  if ( user_capk > 0 && user_capk < 10000000 )
-    capk = user_capk;
+  v->zoomlevel = 1.0;  // zoomlevel of 1.0 arbitrarily defined to be an x-width of 3.1.
+  if ( opt->user_zoomlevel > 0.00001 && opt->user_zoomlevel < 10000000.0 )
+    v->zoomlevel = opt->user_zoomlevel;
+  double fulldx = 3.1 / v->zoomlevel;
+  double fulldy = (3.1 / v->zoomlevel) * ((double)v->resoly /(double)v->resolx);
 
-  FILE* fpout = stdout;
-  if ( userfilename != NULL ) {
-    FILE* fdtest = fopen( userfilename, "r" );
-    if ( fdtest != NULL ) {
-      printf("Output file \"%s\" already exists.  Refusing to overwrite.  Exiting.\n\n", userfilename );
-      fclose( fdtest );
-      free( userfilename );
-      return -1;
-    }
-    fpout = fopen( userfilename, "wb" );
-    if ( fpout == NULL ) {
-      printf("Error: Could not open file \"%s\" for write.  Exiting.\n\n", userfilename );
-      free( userfilename );
-      return -1;
-    }
+  v->pixelwidth = fulldx/(double)v->resolx;  // Could of just as easily been fulldy/(double)resoly
+  double halfpixel = v->pixelwidth / 2.0;
+
+  double xmin = v->centerx - fulldx / 2.0;
+  v->xminplushalf = xmin + halfpixel; // like to use the middles of pixels
+  double ymax = v->centery + fulldy / 2.0;
+  v->ymaxlesshalf = ymax - halfpixel; // like to use the middles of pixels
+}
+
+// Returns the number of iterations before pixel (x,y) escaped, or capk if it never did.
+int IteratePixel( const struct view* v, long x, long y ) {
+
+  double z[2];
+  StartPixel( v, x, y, z );
+  return ContinuePixel( v, x, y, -1, v->capk, z );
+}
+
+// The z of pixel (x,y) before its first iteration.
+void StartPixel( const struct view* v, long x, long y, double* z ) {
+
+  z[0] = 0.0;
+  z[1] = 0.0;
+  if ( v->MakeJuliaSet ) {
+    z[0] = v->xminplushalf + x * v->pixelwidth;
+    z[1] = v->ymaxlesshalf - y * v->pixelwidth;
   }
+}
 
-  long resolx = 1024;  // horizontal resolution in pixels
-  long resoly = 768;   // vertical resolution in pixels
-  if ( user_resolutionoverride ) {
-    resolx = user_resolx;
-    resoly = user_resoly;
+// Carry on iterating pixel (x,y) from iteration k (-1 before the first) and z = z[0] + z[1]i,
+// up to capk iterations.  Returns the new k and leaves the new z behind, so it can be carried
+// on with again.  An orbit that has escaped has a norm of m or more.
+int ContinuePixel( const struct view* v, long x, long y, int k, int capk, double* z ) {
+
+  double z_r = z[0];
+  double z_i = z[1];
+  double c_r = v->c_r;
+  double c_i = v->c_i;
+
+  if ( !v->MakeJuliaSet ) {  // Make the Mandelbrot Set
+    c_r = v->xminplushalf + x * v->pixelwidth;
+    c_i = v->ymaxlesshalf - y * v->pixelwidth;
   }
 
-  double zoomlevel = 1.0;  // zoomlevel of 1.0 arbitrarily defined to be an x-width of 3.1.
-  if ( user_zoomlevel > 0.00001 && user_zoomlevel < 10000000.0 )
-    zoomlevel = user_zoomlevel;
-  double fulldx = 3.1 / zoomlevel;
-  double fulldy = (3.1 / zoomlevel) * ((double)resoly /(double)resolx);
+  double norm = 0.0;
+  if ( k >= 0 )
+    norm = z_r * z_r + z_i * z_i;
 
-  double pixelwidth = fulldx/(double)resolx;  // Could of just as easily been fulldy/(double)resoly
-  double halfpixel = pixelwidth / 2.0;
+  double z_r_save = z_r;
+  if ( v->hasattractor ) {
+    while ( norm < m && k < capk ) {  // as below, stopping early once the orbit is caught by the attractor
+      z_r_save = z_r;
+      z_r = z_r_save * z_r_save - z_i * z_i + c_r;
+      z_i = 2 * z_r_save * z_i + c_i;
+      k++;
+      norm = z_r * z_r + z_i * z_i;
 
-  double xmin = centerx - fulldx / 2.0;
-  double xminplushalf = xmin + halfpixel; // like to use the middles of pixels
-  double ymax = centery + fulldy / 2.0;
-  double ymaxlesshalf = ymax - halfpixel; // like to use the middles of pixels
+      double d_r = z_r - v->attractor_r;
+      double d_i = z_i - v->attractor_i;
+      if ( d_r * d_r + d_i * d_i < v->attractorradius2 ) {
+        k = capk;  // the disc maps into itself, so carrying on lands straight back in it
+        break;
+      }
+    }
+  }
+  else {
+    while ( norm < m && k < capk ) {  // repeatedly iterating z = z^2 + c  where z & c are complex numbers
+      z_r_save = z_r;
+      z_r = z_r_save * z_r_save - z_i * z_i + c_r;
+      z_i = 2 * z_r_save * z_i + c_i;
+      k++;
+      norm = z_r * z_r + z_i * z_i;
+    }
+  }
 
+  z[0] = z_r;
+  z[1] = z_i;
+  return k;
+}
 
-  const double m  = 100.0;  // min norm to be considered an escapee
+// Fill kbuf (w*h entries, row-major) with the iteration counts of the given block of pixels.
+void RenderTile( const struct view* v, long x0, long y0, long w, long h, int* kbuf ) {
 
+  long x,y;
+  for ( y = 0; y < h; y++ )
+    for ( x = 0; x < w; x++ )
+      kbuf[y * w + x] = IteratePixel( v, x0 + x, y0 + y );
+}
 
-  struct pixel holdpal[256];
-  initpal( holdpal );
+// Map iteration counts to colors.
+void ColorPixels( const int* kbuf, long count, const struct colormap* cm, struct pixel* out ) {
 
-  fprintf( fpout, "P6" );
-  fwrite( CRLF, 1, 2, fpout );
+  const struct pixel* lut = cm->lut;
+  long i;
+  if ( cm->period == 0 ) {
+    for ( i = 0; i < count; i++ )
+      out[i] = lut[kbuf[i]];
+  }
+  else {
+    int capk = cm->capk;
+    int period = cm->period;
+    for ( i = 0; i < count; i++ )
+      out[i] = kbuf[i] == capk ? lut[period] : lut[kbuf[i] % period];
+  }
+}
 
-  fprintf( fpout, "%ld %ld", resolx, resoly );
-  fwrite( CRLF, 1, 2, fpout );
+// Supplies the rows of a render to WriteImageBands().
+void RenderRows( void* ctx, long y0, long rows, struct pixel* out ) {
 
-  fprintf( fpout, "255" );
-  fwrite( CRLF, 1, 2, fpout );
+  struct renderrows* rr = (struct renderrows*) ctx;
+  int* kbuf = (int*) malloc( sizeof(int) * rr->v->resolx * rows );
+  if ( kbuf == NULL ) {
+    memset( out, 0, sizeof(struct pixel) * rr->v->resolx * rows );
+    return;
+  }
+  RenderTile( rr->v, 0, y0, rr->v->resolx, rows, kbuf );
+  ColorPixels( kbuf, rr->v->resolx * rows, rr->cm, out );
+  free( kbuf );
+}
 
-  long x,y;
-  for ( y = 0; y < resoly; y++ ) {
-    for ( x = 0; x < resolx; x++ ) {
-      double z_r = 0.0;
-      double z_i = 0.0;
+/* Julia Set attractors.                                                 */
+/*                                                                       */
+/* When c is inside the Mandelbrot Set, the critical point is drawn to   */
+/* an attracting cycle, and so is every interior point of the Julia Set. */
+/* Those points would otherwise be iterated all the way to capk.  The    */
+/* cycle is found once per c (and kept in a small cache, so pans and     */
+/* zooms of the same Julia Set reuse it) together with the radius of a   */
+/* disc around one cycle point that p iterations map into itself.  An    */
+/* orbit that lands in the disc can never escape, so it is counted as    */
+/* reaching capk right there.  The images are unchanged.                 */
 
-      if ( MakeJuliaSet ) {
-        z_r = xminplushalf + x * pixelwidth;
-        z_i = ymaxlesshalf - y * pixelwidth;
-      }
-      else {  // Make the Mandelbrot Set
-        c_r = xminplushalf + x * pixelwidth;
-        c_i = ymaxlesshalf - y * pixelwidth;
-      }
+#define ATTRACTORSEARCH        100000   // iterations of the critical orbit to look for a cycle in
+#define MAXATTRACTORPERIOD     4096
+#define ATTRACTORCACHESLOTS    64
+#define ATTRACTORSAMPLES       64       // points around the disc edge to check
 
-      int k = -1;
-      double norm = 0.0;
+struct cachedattractor
+{
+  int             used;
+  double          c_r;
+  double          c_i;
+  int             found;
+  double          point_r;
+  double          point_i;
+  double          radius2;
+  unsigned long   lastused;
+};
 
-      double z_r_save = z_r;
-      while ( norm < m && k < capk ) {  // repeatedly iterating z = z^2 + c  where z & c are complex numbers
-        z_r_save = z_r;
-        z_r = z_r_save * z_r_save - z_i * z_i + c_r;
-        z_i = 2 * z_r_save * z_i + c_i;
-        k++;
-        norm = z_r * z_r + z_i * z_i;
-      }
+static struct cachedattractor AttractorCache[ATTRACTORCACHESLOTS];
+static unsigned long AttractorClock = 0;
+#if defined(HAVE_PTHREADS)
+static pthread_mutex_t AttractorLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-      if ( k == capk )
-          k = 255;
-      else
-          k %= 254;
+// Find an attracting cycle of z^2 + c.  On success, *point is on the cycle and
+// the disc of radius sqrt(*radius2) around it is mapped into itself by f^period.
+static int FindAttractor( double c_r, double c_i, double* point_r, double* point_i, double* radius2 ) {
 
-      fwrite( &holdpal[k], 1, 3, fpout );
+  // follow the critical orbit, remembering a point at every power of 2 (Brent)
+  double z_r = 0.0;
+  double z_i = 0.0;
+  double saved_r = 0.0;
+  double saved_i = 0.0;
+  long sincesaved = 0;
+  long nextsave = 1;
+  int period = 0;
+  long i;
+  for ( i = 0; i < ATTRACTORSEARCH && period == 0; i++ ) {
+    double z_r_save = z_r;
+    z_r = z_r_save * z_r_save - z_i * z_i + c_r;
+    z_i = 2 * z_r_save * z_i + c_i;
+    if ( z_r * z_r + z_i * z_i >= m )
+      return 0;  // c is outside the Mandelbrot Set
+    sincesaved++;
+    double d_r = z_r - saved_r;
+    double d_i = z_i - saved_i;
+    if ( d_r * d_r + d_i * d_i < 1e-20 && sincesaved <= MAXATTRACTORPERIOD )
+      period = sincesaved;
+    if ( sincesaved == nextsave ) {
+      saved_r = z_r;
+      saved_i = z_i;
+      sincesaved = 0;
+      nextsave *= 2;
     }
   }
+  if ( period == 0 )
+    return 0;
 
-  if ( fpout != stdout ) {
-    fclose(fpout);
-    fpout = NULL;
+  // polish the cycle point with Newton's method on f^p(z) - z, finding the multiplier on the way
+  double lambda_r = 1.0;
+  double lambda_i = 0.0;
+  int step;
+  for ( step = 0; step < 8; step++ ) {
+    double w_r = z_r;
+    double w_i = z_i;
+    lambda_r = 1.0;
+    lambda_i = 0.0;
+    int j;
+    for ( j = 0; j < period; j++ ) {
+      double t = 2 * ( lambda_r * w_r - lambda_i * w_i );
+      lambda_i = 2 * ( lambda_r * w_i + lambda_i * w_r );
+      lambda_r = t;
+      double w_r_save = w_r;
+      w_r = w_r_save * w_r_save - w_i * w_i + c_r;
+      w_i = 2 * w_r_save * w_i + c_i;
+    }
+    double g_r = w_r - z_r;  // f^p(z) - z
+    double g_i = w_i - z_i;
+    double dg_r = lambda_r - 1.0;
+    double dg_i = lambda_i;
+    double denom = dg_r * dg_r + dg_i * dg_i;
+    if ( denom == 0.0 )
+      break;
+    z_r -= ( g_r * dg_r + g_i * dg_i ) / denom;
+    z_i -= ( g_i * dg_r - g_r * dg_i ) / denom;
   }
 
-  if ( userfilename != NULL ) {
-    free( userfilename );
-    userfilename = NULL;
+  double lambda = sqrt( lambda_r * lambda_r + lambda_i * lambda_i );
+  if ( lambda >= 1.0 )
+    return 0;
+  double shrink = ( 1.0 + lambda ) / 2.0;
+
+  // Shrink the disc until f^p maps its edge well inside it.  f^p(w) - z is
+  // analytic, so by the maximum modulus principle the whole disc goes inside.
+  double radius = 0.25;
+  for ( step = 0; step < 40; step++, radius /= 2.0 ) {
+    int inside = 1;
+    int s;
+    for ( s = 0; s < ATTRACTORSAMPLES && inside; s++ ) {
+      double angle = 2.0 * 3.14159265358979323846 * s / ATTRACTORSAMPLES;
+      double w_r = z_r + radius * cos( angle );
+      double w_i = z_i + radius * sin( angle );
+      int j;
+      for ( j = 0; j < period && inside; j++ ) {
+        double w_r_save = w_r;
+        w_r = w_r_save * w_r_save - w_i * w_i + c_r;
+        w_i = 2 * w_r_save * w_i + c_i;
+        if ( w_r * w_r + w_i * w_i >= m )
+          inside = 0;
+      }
+      double d_r = w_r - z_r;
+      double d_i = w_i - z_i;
+      if ( d_r * d_r + d_i * d_i > ( shrink * radius ) * ( shrink * radius ) )
+        inside = 0;
+    }
+    if ( inside ) {
+      *point_r = z_r;
+      *point_i = z_i;
+      *radius2 = radius * radius;
+      return 1;
+    }
   }
 
   return 0;
 }
 
-void printusage() {
-  printf( "\n" );
-  printf( "fractals version %s\n\n", VersionStr );
+// Set the Julia Set constant of a view, along with its cached attractor.
+void SetJuliaConstant( struct view* v, double c_r, double c_i ) {
 
-  printf( "usage: fractals [options]\n\n" );
+  v->c_r = c_r;
+  v->c_i = c_i;
+  v->hasattractor = 0;
+  if ( !v->MakeJuliaSet || v->deterministic )
+    return;
 
-  printf( "options:\n" );
-  printf( "  -c real_x,real_y    -- specifies the center coordinates (real_x,real_y).\n" );
-  printf( "  -h                  -- prints this help and exits.\n" );
-  printf( "  -j p,q              -- generate a Julia Set with complex c = p + qi.\n" );
-  printf( "  -m integer          -- specifies the maximum # of iterations per pixel\n");
-  printf( "                         before stopping.\n" );
-  printf( "  -o filename         -- save to this output file.\n" );
-  printf( "  -r integer,integer  -- image resolution.\n" );
-  printf( "  -v                  -- print version and exit.\n" );
-  printf( "  -z real             -- set zoom level to real.\n\n" );
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_lock( &AttractorLock );
+#endif
+  struct cachedattractor* slot = NULL;
+  int i;
+  for ( i = 0; i < ATTRACTORCACHESLOTS; i++ )
+    if ( AttractorCache[i].used && AttractorCache[i].c_r == c_r && AttractorCache[i].c_i == c_i ) {
+      slot = &AttractorCache[i];
+      break;
+    }
 
-  printf( " modes:\n" );
-  printf( "   fractals has 2 modes.  The Mandelbrot mode is the default, but it will\n" );
-  printf( "   switch to Julia Set mode if a \"-j p,q\" option is used.\n\n" );
+  if ( slot == NULL ) {
+    slot = &AttractorCache[0];
+    for ( i = 0; i < ATTRACTORCACHESLOTS; i++ ) {
+      if ( !AttractorCache[i].used ) {
+        slot = &AttractorCache[i];
+        break;
+      }
+      if ( AttractorCache[i].lastused < slot->lastused )
+        slot = &AttractorCache[i];
+    }
+    slot->used = 1;
+    slot->c_r = c_r;
+    slot->c_i = c_i;
+    slot->found = FindAttractor( c_r, c_i, &slot->point_r, &slot->point_i, &slot->radius2 );
+  }
+  slot->lastused = ++AttractorClock;
 
-  printf( " defaults:\n" );
-  printf( "   -- The default center is (0.75,0.0) for Mandelbrot mode and (0.0,0.0) for\n" );
-  printf( "      Julia Set mode.\n" );
-  printf( "   -- The default for m is 2048.\n" );
-  printf( "   -- The default output is to stdout.\n" );
-  printf( "   -- The default image resolution is 1024x768.\n" );
-  printf( "   -- The default zoom level is 1.0 which is a real x-width of 3.1.\n\n" );
+  v->hasattractor = slot->found;
+  v->attractor_r = slot->point_r;
+  v->attractor_i = slot->point_i;
+  v->attractorradius2 = slot->radius2;
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_unlock( &AttractorLock );
+#endif
+}
 
-  printf( " examples:\n" );
-  printf( "   fractals > mset.ppm\n" );
-  printf( "     -- produces a Mandelbrot Set called \"mset.ppm\".\n" );
-  printf( "   fractals -o mset.ppm\n" );
-  printf( "     -- same result as \"fractals > mset.ppm\".\n" );
-  printf( "   fractals | pnmtopng > mset.png\n" );
-  printf( "     -- create a loss-less compressed .png file \"mset.png\".  Need \"netpbm\"\n" );
-  printf( "        installed.\n" );
-  printf( "   fractals | pnmtojpeg > mset.jpg\n" );
-  printf( "     -- create a lossy compressed jpeg file \"mset.jpg\".  Need \"netpbm\"\n" );
-  printf( "        installed.\n" );
-  printf( "   fractals -j -.194,.6557 > jset.ppm\n" );
-  printf( "     -- create the Julia Set with c = -.194 + .6557i and save in \"jset.ppm\".\n" );
-  printf( "   fractals -j-.194,.6557 -c-.32,0.27 -r1280x960 -m3000 -z4.75 > jset2.ppm\n" );
-  printf( "     -- create the Julia Set with c = -.194 + .6557i and save in \"jset2.ppm\".\n" );
-  printf( "        set center to (-0.32,0.27), resolution to 1280 by 960 pixels, max\n" );
-  printf( "        iterations to 3000 and zoom level to 4.75.\n\n" );
+/* Adaptive iteration cap.                                               */
+/*                                                                       */
+/* With --adaptive, every pixel is first iterated to a low cap.  Pixels  */
+/* that reached it and touch a pixel that escaped are the ones a higher  */
+/* cap could still change, so only they are carried on with, from their  */
+/* saved z, while the cap doubles.  Each round's escapes put their       */
+/* neighbours on the next round's list.  It stops once a round turns up */
+/* no new escapes, or at -m (ADAPTIVEMAXCAP without -m).  Pixels deep   */
+/* inside the set are never iterated past the first cap.  The whole     */
+/* image's iteration counts and orbits are kept in memory.              */
+/*                                                                       */
+/* They are kept a TILESIZE square tile at a time rather than row by     */
+/* row, so the neighbours of a pixel are mostly a few hundred bytes away */
+/* instead of a whole row (megabytes, for a very wide image), and a work */
+/* item's pixels are a compact patch.  Rows are put back together only   */
+/* as the image is written.                                              */
 
-  printf( "\n\n" );
-}
+#define ORBITCHUNK         1024      // pixels per work item
 
-// parse out two doubles from inputstr
-int Get2Tuple( char* inputstr, double* first, double* second ) {
+// Where pixel (x,y) is kept in a tiled buffer: tile rows from the top, the tiles of a
+// row from the left, and the pixels of a tile row by row.  Edge tiles are just smaller.
+static long TiledIndex( long resolx, long resoly, long x, long y ) {
 
-  char* tempstr = strdup( inputstr );
+  long x0 = x / TILESIZE * TILESIZE;
+  long y0 = y / TILESIZE * TILESIZE;
+  long w  = resolx - x0 < TILESIZE ? resolx - x0 : TILESIZE;
+  long h  = resoly - y0 < TILESIZE ? resoly - y0 : TILESIZE;
+  return y0 * resolx + x0 * h + ( y - y0 ) * w + ( x - x0 );
+}
 
-  int i;
-  int len = strlen( tempstr );
+// The pixel kept at s in a tiled buffer.
+static void TiledPixel( long resolx, long resoly, long s, long* x, long* y ) {
 
-  char* begdouble1 = NULL;
-  char* begdouble2 = NULL;
+  long y0 = s / ( resolx * TILESIZE ) * TILESIZE;
+  long h  = resoly - y0 < TILESIZE ? resoly - y0 : TILESIZE;
+  s -= y0 * resolx;
+  long x0 = s / ( TILESIZE * h ) * TILESIZE;
+  long w  = resolx - x0 < TILESIZE ? resolx - x0 : TILESIZE;
+  s -= x0 * h;
+  *x = x0 + s % w;
+  *y = y0 + s / w;
+}
 
-  int findbegin = 1;
-  int findnumberparts = 0;
-  for ( i = 0; i < len; i++ ) {
-    int isnumberpart = isdigit( tempstr[i] ) ||  tempstr[i] == '-' || tempstr[i] == '.';
-    if ( findbegin && isnumberpart ) {
-      if ( begdouble1 == NULL )
-        begdouble1 = tempstr + i;
-      else
-        begdouble2 = tempstr + i;
-      findbegin = 0;
-      findnumberparts = 1;
+// Step (x,y) on to the pixel kept next in a tiled buffer.
+static void NextTiledPixel( long resolx, long resoly, long* x, long* y ) {
+
+  long x0 = *x / TILESIZE * TILESIZE;
+  long y0 = *y / TILESIZE * TILESIZE;
+  long w  = resolx - x0 < TILESIZE ? resolx - x0 : TILESIZE;
+  long h  = resoly - y0 < TILESIZE ? resoly - y0 : TILESIZE;
+  if ( ++*x < x0 + w )
+    return;
+  *x = x0;
+  if ( ++*y < y0 + h )
+    return;
+  *x = x0 + w < resolx ? x0 + w : 0;
+  *y = x0 + w < resolx ? y0 : y0 + h;
+}
+
+// Every pixel of an image, part way through its iterations.
+struct orbitstate
+{
+  const struct view*    v;
+  int*                  k;        // iterations done so far
+  double*               z;        // z_r and z_i
+  long*                 pixel;    // the pixel (y * resolx + x) each k and z belongs to, or NULL for every pixel, tiled
+  const long*           list;     // the ones to carry on with, or NULL for all of them
+  long                  count;
+  int                   capk;     // carry on with them up to here
+  long                  next;
+  long                  escaped;  // how many of them escaped
+};
+
+static int OrbitEscaped( const struct orbitstate* os, long s ) {
+
+  const double* z = &os->z[2 * s];
+  return os->k[s] >= 0 && z[0] * z[0] + z[1] * z[1] >= m;
+}
+
+static void* OrbitWorker( void* arg ) {
+
+  struct orbitstate* os = (struct orbitstate*) arg;
+  long resolx = os->v->resolx;
+  long resoly = os->v->resoly;
+  long escaped = 0;
+  long item;
+  while ( ( item = NextWorkItem( &os->next ) ) * ORBITCHUNK < os->count ) {
+    long i, x, y;
+    long end = ( item + 1 ) * ORBITCHUNK < os->count ? ( item + 1 ) * ORBITCHUNK : os->count;
+    if ( os->list == NULL && os->pixel == NULL )
+      TiledPixel( resolx, resoly, item * ORBITCHUNK, &x, &y );
+    for ( i = item * ORBITCHUNK; i < end; i++ ) {
+      long s = os->list != NULL ? os->list[i] : i;
+      if ( os->pixel != NULL ) {
+        x = os->pixel[s] % resolx;
+        y = os->pixel[s] / resolx;
+      }
+      else if ( os->list != NULL )
+        TiledPixel( resolx, resoly, s, &x, &y );
+      else if ( i > item * ORBITCHUNK )
+        NextTiledPixel( resolx, resoly, &x, &y );
+      os->k[s] = ContinuePixel( os->v, x, y, os->k[s], os->capk, &os->z[2 * s] );
+      escaped += OrbitEscaped( os, s );
     }
-    else if ( findnumberparts && !isnumberpart ) {
-      findnumberparts = 0;
-      tempstr[i] = '\0';
-      if ( begdouble2 == NULL )
-        findbegin = 1;
+  }
+
+  AtomicAdd( &os->escaped, escaped );
+  return NULL;
+}
+
+// Carry on with the listed pixels (or all of them) up to capk on the given number of threads.
+// Returns how many of them have escaped.
+static long ContinueOrbits( struct orbitstate* os, const long* list, long count, int capk, int threads ) {
+
+  os->list = list;
+  os->count = count;
+  os->capk = capk;
+  os->next = 0;
+  os->escaped = 0;
+  RunWorkers( threads, OrbitWorker, os );
+  return os->escaped;
+}
+
+// Allocate the orbits of every pixel of v, tiled, all before their first iteration.
+static int StartOrbits( struct orbitstate* os, const struct view* v ) {
+
+  long pixels = v->resolx * v->resoly;
+  memset( os, 0, sizeof(struct orbitstate) );
+  os->v = v;
+  os->k = (int*) malloc( sizeof(int) * pixels );
+  os->z = (double*) malloc( sizeof(double) * 2 * pixels );
+  if ( os->k == NULL || os->z == NULL ) {
+    free( os->k );
+    free( os->z );
+    return -1;
+  }
+
+  long s;
+  long x = 0;
+  long y = 0;
+  for ( s = 0; s < pixels; s++ ) {
+    os->k[s] = -1;
+    StartPixel( v, x, y, &os->z[2 * s] );
+    NextTiledPixel( v->resolx, v->resoly, &x, &y );
+  }
+  return 0;
+}
+
+struct orbitrows
+{
+  const struct orbitstate*  os;
+  const struct colormap*    cm;
+};
+
+// Supplies the rows of a finished image to WriteImageBands().  Pixels that
+// haven't escaped are colored as reaching capk, whatever cap they stopped at.
+static void OrbitRows( void* ctx, long y0, long rows, struct pixel* out ) {
+
+  struct orbitrows* orr = (struct orbitrows*) ctx;
+  const struct orbitstate* os = orr->os;
+  long resolx = os->v->resolx;
+  long resoly = os->v->resoly;
+  int kbuf[TILESIZE];
+
+  // each row of a tile is in one piece
+  long x0, y;
+  for ( y = y0; y < y0 + rows; y++ )
+    for ( x0 = 0; x0 < resolx; x0 += TILESIZE ) {
+      long w = resolx - x0 < TILESIZE ? resolx - x0 : TILESIZE;
+      long s = TiledIndex( resolx, resoly, x0, y );
+      long i;
+      for ( i = 0; i < w; i++ )
+        kbuf[i] = OrbitEscaped( os, s + i ) ? os->k[s + i] : orr->cm->capk;
+      ColorPixels( kbuf, w, orr->cm, &out[( y - y0 ) * resolx + x0] );
     }
+}
+
+// Render v, with the adaptive cap described above up to maxcap or else with v's own cap,
+// and write the image to fp, equalized or not.  With orbitspath, the orbits of the pixels
+// that were colored as reaching the cap are saved there, for --continue-to.
+int RenderOrbits( const struct view* v, int adaptive, int maxcap, const struct palette* pal, int equalize,
+                  int threads, FILE* fp, int format, const char* orbitspath ) {
+
+  long resolx = v->resolx;
+  long resoly = v->resoly;
+  long pixels = resolx * resoly;
+
+  struct orbitstate os;
+  long* list = (long*) malloc( sizeof(long) * pixels );
+  if ( list == NULL || StartOrbits( &os, v ) != 0 ) {
+    free( list );
+    fprintf( stderr, "Error: Not enough memory to keep the orbits of every pixel.\n" );
+    return -1;
   }
 
-  int fail = 1;
-  if ( begdouble1 != NULL && begdouble2 != NULL ) {
-    *first  = atof( begdouble1 );
-    *second = atof( begdouble2 );
-    fail = 0;
+  int capk = v->capk;
+  if ( adaptive )
+    capk = ADAPTIVESTARTCAP < maxcap ? ADAPTIVESTARTCAP : maxcap;
+  ContinueOrbits( &os, NULL, pixels, capk, threads );
+
+  int rounds = 1;
+  while ( adaptive && capk < maxcap ) {
+
+    // the pixels still going with a neighbour that escaped, in the order they are kept
+    long count = 0;
+    long s = 0;
+    long x = 0;
+    long y = 0;
+    for ( ; s < pixels; s++, NextTiledPixel( resolx, resoly, &x, &y ) ) {
+      if ( OrbitEscaped( &os, s ) )
+        continue;
+      long x0 = x / TILESIZE * TILESIZE;
+      long y0 = y / TILESIZE * TILESIZE;
+      long w  = resolx - x0 < TILESIZE ? resolx - x0 : TILESIZE;
+      long h  = resoly - y0 < TILESIZE ? resoly - y0 : TILESIZE;
+      int edge = 0;
+      if ( x > x0 && x < x0 + w - 1 && y > y0 && y < y0 + h - 1 )  // all the neighbours are in this tile
+        edge = OrbitEscaped( &os, s - w - 1 ) || OrbitEscaped( &os, s - w ) || OrbitEscaped( &os, s - w + 1 )
+               || OrbitEscaped( &os, s - 1 ) || OrbitEscaped( &os, s + 1 )
+               || OrbitEscaped( &os, s + w - 1 ) || OrbitEscaped( &os, s + w ) || OrbitEscaped( &os, s + w + 1 );
+      else {
+        long nx, ny;
+        for ( ny = y - 1; ny <= y + 1 && !edge; ny++ )
+          for ( nx = x - 1; nx <= x + 1 && !edge; nx++ )
+            if ( nx >= 0 && nx < resolx && ny >= 0 && ny < resoly )
+              edge = OrbitEscaped( &os, TiledIndex( resolx, resoly, nx, ny ) );
+      }
+      if ( edge )
+        list[count++] = s;
+    }
+    if ( count == 0 )
+      break;
+
+    capk = capk < maxcap / 2 ? capk * 2 : maxcap;
+    long escaped = ContinueOrbits( &os, list, count, capk, threads );
+    rounds++;
+    if ( escaped == 0 )
+      break;
   }
+  free( list );
+  if ( adaptive )
+    fprintf( stderr, "Adaptive cap reached %d after %d rounds.\n", capk, rounds );
 
-  free( tempstr );
-  tempstr = NULL;
+  // one pass over the iteration counts for the histogram
+  struct colormap cm;
+  int retval = -1;
+  if ( equalize ) {
+    long long* hist = (long long*) calloc( capk, sizeof(long long) );
+    long s;
+    for ( s = 0; hist != NULL && s < pixels; s++ )
+      if ( OrbitEscaped( &os, s ) && os.k[s] < capk )
+        hist[os.k[s]]++;
+    if ( hist != NULL )
+      retval = MakeEqualizedColorMap( pal, capk, hist, &cm );
+    free( hist );
+  }
+  else
+    retval = MakeColorMap( pal, capk, &cm );
 
-  return fail;
+  struct orbitrows orr = { &os, &cm };
+  if ( retval == 0 ) {
+    retval = WriteImageBands( fp, format, resolx, resoly, threads, OrbitRows, &orr );
+    FreeColorMap( &cm );
+  }
+  if ( retval == 0 && orbitspath != NULL && WriteOrbits( orbitspath, &os, pixels, capk ) != 0 ) {
+    fprintf( stderr, "Error: Could not save the orbits to \"%s\".\n", orbitspath );
+    retval = -1;
+  }
+  free( os.k );
+  free( os.z );
+  return retval;
 }
 
-// parse out two longs from inputstr
-int Get2Tuple( char* inputstr, long* first, long* second ) {
+/* Image output.                                                         */
+/*                                                                       */
+/* Besides the raw PPM, images can be written as PNG or QOI with no      */
+/* outside libraries.  The PNG deflate stream is made with a simple      */
+/* LZ77 matcher and the fixed Huffman codes, which suits fractal images  */
+/* well after PNG filtering (long runs of the same few bytes).           */
+/*                                                                       */
+/* Large images are cut into bands of BANDROWS rows.  Worker threads     */
+/* render, filter and deflate whole bands independently, each band       */
+/* ending on a byte boundary with an empty stored block the way pigz     */
+/* does it, and the finished bands are written out in order.  The        */
+/* Adler-32 checksums of the bands are combined at the end.  QOI is      */
+/* inherently sequential, but is cheap enough to encode as the bands are */
+/* written.  Every image goes through the same StartImage(), EncodeRows() */
+/* and FinishImage(), so whatever writes it, the daemon included, gets   */
+/* the format that ImageFormat() picked from -f or the file name.        */
 
-  char* tempstr = strdup( inputstr );
+#define BANDROWS          32
+#define DEFLATEWINDOW     32768
+#define DEFLATEHASHBITS   15
+#define DEFLATEMAXCHAIN   32
+#define DEFLATEMAXMATCH   258
+
+// A growable in-memory byte buffer.
+struct membuf
+{
+  unsigned char*  data;
+  long            len;
+  long            cap;
+  int             failed;
+};
+
+struct qoistate
+{
+  unsigned char   index[64][3];
+  unsigned char   used[64];     // index entries start out as transparent black, which we never match
+  unsigned char   prev[3];
+  int             run;
+};
+
+// Where an image being encoded a few rows at a time is up to.
+struct imageencoder
+{
+  int             format;
+  long            w;
+  long            rows;         // encoded so far
+  unsigned long   adler;        // of the filtered PNG scanlines so far
+  struct qoistate qoi;
+};
+
+static int MemReserve( struct membuf* mb, long extra ) {
+
+  if ( mb->len + extra <= mb->cap )
+    return 0;
+  long newcap = mb->cap > 0 ? mb->cap : 4096;
+  while ( newcap < mb->len + extra )
+    newcap *= 2;
+  unsigned char* newdata = (unsigned char*) realloc( mb->data, newcap );
+  if ( newdata == NULL ) {
+    mb->failed = 1;
+    return -1;
+  }
+  mb->data = newdata;
+  mb->cap = newcap;
+  return 0;
+}
+
+static void MemAppend( struct membuf* mb, const void* data, long len ) {
+
+  if ( MemReserve( mb, len ) != 0 )
+    return;
+  memcpy( mb->data + mb->len, data, len );
+  mb->len += len;
+}
+
+static void MemAppendByte( struct membuf* mb, unsigned char byte ) {
+
+  if ( mb->len < mb->cap || MemReserve( mb, 1 ) == 0 )
+    mb->data[mb->len++] = byte;
+}
+
+static void MemAppendBE32( struct membuf* mb, unsigned long value ) {
+
+  unsigned char bytes[4] = { (unsigned char)( value >> 24 ), (unsigned char)( value >> 16 ),
+                             (unsigned char)( value >> 8 ), (unsigned char) value };
+  MemAppend( mb, bytes, 4 );
+}
+
+unsigned long Crc32( unsigned long crc, const unsigned char* data, long len ) {
+
+  // The PNG polynomial 0xEDB88320, one entry per byte.  It is a constant so that
+  // images encoded at once on several threads have nothing to share.
+  static const unsigned long table[256] = {
+    0x00000000UL, 0x77073096UL, 0xEE0E612CUL, 0x990951BAUL, 0x076DC419UL, 0x706AF48FUL,
+    0xE963A535UL, 0x9E6495A3UL, 0x0EDB8832UL, 0x79DCB8A4UL, 0xE0D5E91EUL, 0x97D2D988UL,
+    0x09B64C2BUL, 0x7EB17CBDUL, 0xE7B82D07UL, 0x90BF1D91UL, 0x1DB71064UL, 0x6AB020F2UL,
+    0xF3B97148UL, 0x84BE41DEUL, 0x1ADAD47DUL, 0x6DDDE4EBUL, 0xF4D4B551UL, 0x83D385C7UL,
+    0x136C9856UL, 0x646BA8C0UL, 0xFD62F97AUL, 0x8A65C9ECUL, 0x14015C4FUL, 0x63066CD9UL,
+    0xFA0F3D63UL, 0x8D080DF5UL, 0x3B6E20C8UL, 0x4C69105EUL, 0xD56041E4UL, 0xA2677172UL,
+    0x3C03E4D1UL, 0x4B04D447UL, 0xD20D85FDUL, 0xA50AB56BUL, 0x35B5A8FAUL, 0x42B2986CUL,
+    0xDBBBC9D6UL, 0xACBCF940UL, 0x32D86CE3UL, 0x45DF5C75UL, 0xDCD60DCFUL, 0xABD13D59UL,
+    0x26D930ACUL, 0x51DE003AUL, 0xC8D75180UL, 0xBFD06116UL, 0x21B4F4B5UL, 0x56B3C423UL,
+    0xCFBA9599UL, 0xB8BDA50FUL, 0x2802B89EUL, 0x5F058808UL, 0xC60CD9B2UL, 0xB10BE924UL,
+    0x2F6F7C87UL, 0x58684C11UL, 0xC1611DABUL, 0xB6662D3DUL, 0x76DC4190UL, 0x01DB7106UL,
+    0x98D220BCUL, 0xEFD5102AUL, 0x71B18589UL, 0x06B6B51FUL, 0x9FBFE4A5UL, 0xE8B8D433UL,
+    0x7807C9A2UL, 0x0F00F934UL, 0x9609A88EUL, 0xE10E9818UL, 0x7F6A0DBBUL, 0x086D3D2DUL,
+    0x91646C97UL, 0xE6635C01UL, 0x6B6B51F4UL, 0x1C6C6162UL, 0x856530D8UL, 0xF262004EUL,
+    0x6C0695EDUL, 0x1B01A57BUL, 0x8208F4C1UL, 0xF50FC457UL, 0x65B0D9C6UL, 0x12B7E950UL,
+    0x8BBEB8EAUL, 0xFCB9887CUL, 0x62DD1DDFUL, 0x15DA2D49UL, 0x8CD37CF3UL, 0xFBD44C65UL,
+    0x4DB26158UL, 0x3AB551CEUL, 0xA3BC0074UL, 0xD4BB30E2UL, 0x4ADFA541UL, 0x3DD895D7UL,
+    0xA4D1C46DUL, 0xD3D6F4FBUL, 0x4369E96AUL, 0x346ED9FCUL, 0xAD678846UL, 0xDA60B8D0UL,
+    0x44042D73UL, 0x33031DE5UL, 0xAA0A4C5FUL, 0xDD0D7CC9UL, 0x5005713CUL, 0x270241AAUL,
+    0xBE0B1010UL, 0xC90C2086UL, 0x5768B525UL, 0x206F85B3UL, 0xB966D409UL, 0xCE61E49FUL,
+    0x5EDEF90EUL, 0x29D9C998UL, 0xB0D09822UL, 0xC7D7A8B4UL, 0x59B33D17UL, 0x2EB40D81UL,
+    0xB7BD5C3BUL, 0xC0BA6CADUL, 0xEDB88320UL, 0x9ABFB3B6UL, 0x03B6E20CUL, 0x74B1D29AUL,
+    0xEAD54739UL, 0x9DD277AFUL, 0x04DB2615UL, 0x73DC1683UL, 0xE3630B12UL, 0x94643B84UL,
+    0x0D6D6A3EUL, 0x7A6A5AA8UL, 0xE40ECF0BUL, 0x9309FF9DUL, 0x0A00AE27UL, 0x7D079EB1UL,
+    0xF00F9344UL, 0x8708A3D2UL, 0x1E01F268UL, 0x6906C2FEUL, 0xF762575DUL, 0x806567CBUL,
+    0x196C3671UL, 0x6E6B06E7UL, 0xFED41B76UL, 0x89D32BE0UL, 0x10DA7A5AUL, 0x67DD4ACCUL,
+    0xF9B9DF6FUL, 0x8EBEEFF9UL, 0x17B7BE43UL, 0x60B08ED5UL, 0xD6D6A3E8UL, 0xA1D1937EUL,
+    0x38D8C2C4UL, 0x4FDFF252UL, 0xD1BB67F1UL, 0xA6BC5767UL, 0x3FB506DDUL, 0x48B2364BUL,
+    0xD80D2BDAUL, 0xAF0A1B4CUL, 0x36034AF6UL, 0x41047A60UL, 0xDF60EFC3UL, 0xA867DF55UL,
+    0x316E8EEFUL, 0x4669BE79UL, 0xCB61B38CUL, 0xBC66831AUL, 0x256FD2A0UL, 0x5268E236UL,
+    0xCC0C7795UL, 0xBB0B4703UL, 0x220216B9UL, 0x5505262FUL, 0xC5BA3BBEUL, 0xB2BD0B28UL,
+    0x2BB45A92UL, 0x5CB36A04UL, 0xC2D7FFA7UL, 0xB5D0CF31UL, 0x2CD99E8BUL, 0x5BDEAE1DUL,
+    0x9B64C2B0UL, 0xEC63F226UL, 0x756AA39CUL, 0x026D930AUL, 0x9C0906A9UL, 0xEB0E363FUL,
+    0x72076785UL, 0x05005713UL, 0x95BF4A82UL, 0xE2B87A14UL, 0x7BB12BAEUL, 0x0CB61B38UL,
+    0x92D28E9BUL, 0xE5D5BE0DUL, 0x7CDCEFB7UL, 0x0BDBDF21UL, 0x86D3D2D4UL, 0xF1D4E242UL,
+    0x68DDB3F8UL, 0x1FDA836EUL, 0x81BE16CDUL, 0xF6B9265BUL, 0x6FB077E1UL, 0x18B74777UL,
+    0x88085AE6UL, 0xFF0F6A70UL, 0x66063BCAUL, 0x11010B5CUL, 0x8F659EFFUL, 0xF862AE69UL,
+    0x616BFFD3UL, 0x166CCF45UL, 0xA00AE278UL, 0xD70DD2EEUL, 0x4E048354UL, 0x3903B3C2UL,
+    0xA7672661UL, 0xD06016F7UL, 0x4969474DUL, 0x3E6E77DBUL, 0xAED16A4AUL, 0xD9D65ADCUL,
+    0x40DF0B66UL, 0x37D83BF0UL, 0xA9BCAE53UL, 0xDEBB9EC5UL, 0x47B2CF7FUL, 0x30B5FFE9UL,
+    0xBDBDF21CUL, 0xCABAC28AUL, 0x53B39330UL, 0x24B4A3A6UL, 0xBAD03605UL, 0xCDD70693UL,
+    0x54DE5729UL, 0x23D967BFUL, 0xB3667A2EUL, 0xC4614AB8UL, 0x5D681B02UL, 0x2A6F2B94UL,
+    0xB40BBE37UL, 0xC30C8EA1UL, 0x5A05DF1BUL, 0x2D02EF8DUL
+  };
+
+  crc ^= 0xFFFFFFFFUL;
+  long i;
+  for ( i = 0; i < len; i++ )
+    crc = table[( crc ^ data[i] ) & 0xFF] ^ ( crc >> 8 );
+  return crc ^ 0xFFFFFFFFUL;
+}
+
+unsigned long Adler32( unsigned long adler, const unsigned char* data, long len ) {
+
+  unsigned long s1 = adler & 0xFFFF;
+  unsigned long s2 = adler >> 16;
+  while ( len > 0 ) {
+    long chunk = len < 5552 ? len : 5552;  // the most that can be summed before s2 could overflow
+    len -= chunk;
+    while ( chunk-- > 0 ) {
+      s1 += *data++;
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  return ( s2 << 16 ) | s1;
+}
+
+// The Adler-32 of two blocks one after the other, from the Adler-32 of each and the second's length.
+unsigned long Adler32Combine( unsigned long adler1, unsigned long adler2, long len2 ) {
+
+  const unsigned long BASE = 65521;
+  unsigned long rem = len2 % BASE;
+  unsigned long sum1 = adler1 & 0xFFFF;
+  unsigned long sum2 = ( rem * sum1 ) % BASE;
+  sum1 += ( adler2 & 0xFFFF ) + BASE - 1;
+  sum2 += ( adler1 >> 16 ) + ( adler2 >> 16 ) + BASE - rem;
+  if ( sum1 >= BASE ) sum1 -= BASE;
+  if ( sum1 >= BASE ) sum1 -= BASE;
+  if ( sum2 >= 2 * BASE ) sum2 -= 2 * BASE;
+  if ( sum2 >= BASE ) sum2 -= BASE;
+  return ( sum2 << 16 ) | sum1;
+}
+
+struct bitwriter
+{
+  struct membuf*  mb;
+  unsigned long   bits;
+  int             count;
+};
+
+// Deflate streams are packed least significant bit first.
+static void PutBits( struct bitwriter* bw, unsigned long bits, int count ) {
+
+  bw->bits |= bits << bw->count;
+  bw->count += count;
+  while ( bw->count >= 8 ) {
+    MemAppendByte( bw->mb, (unsigned char) bw->bits );
+    bw->bits >>= 8;
+    bw->count -= 8;
+  }
+}
 
+// Huffman codes are sent most significant bit first, so reverse them for PutBits().
+static void PutCode( struct bitwriter* bw, unsigned long code, int count ) {
+
+  unsigned long reversed = 0;
   int i;
-  int len = strlen( tempstr );
+  for ( i = 0; i < count; i++ )
+    reversed |= ( ( code >> i ) & 1 ) << ( count - 1 - i );
+  PutBits( bw, reversed, count );
+}
 
-  char* beglong1 = NULL;
-  char* beglong2 = NULL;
+// A literal or length symbol in the fixed Huffman code of RFC 1951.
+static void PutFixedSymbol( struct bitwriter* bw, int sym ) {
 
-  int findbegin = 1;
-  int findnumberparts = 0;
-  for ( i = 0; i < len; i++ ) {
-    int isnumberpart = isdigit( tempstr[i] );
-    if ( findbegin && isnumberpart ) {
-      if ( beglong1 == NULL )
-        beglong1 = tempstr + i;
-      else
-        beglong2 = tempstr + i;
-      findbegin = 0;
-      findnumberparts = 1;
+  if ( sym < 144 )
+    PutCode( bw, 0x30 + sym, 8 );
+  else if ( sym < 256 )
+    PutCode( bw, 0x190 + sym - 144, 9 );
+  else if ( sym < 280 )
+    PutCode( bw, sym - 256, 7 );
+  else
+    PutCode( bw, 0xC0 + sym - 280, 8 );
+}
+
+static void PutMatch( struct bitwriter* bw, int len, int dist ) {
+
+  static const int lenbase[29]  = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+  static const int lenextra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+  static const int distbase[30]  = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,
+                                     1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+  static const int distextra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+  int l = 28;
+  while ( lenbase[l] > len )
+    l--;
+  PutFixedSymbol( bw, 257 + l );
+  PutBits( bw, len - lenbase[l], lenextra[l] );
+
+  int d = 29;
+  while ( distbase[d] > dist )
+    d--;
+  PutCode( bw, d, 5 );
+  PutBits( bw, dist - distbase[d], distextra[d] );
+}
+
+// Compress data as one non-final fixed Huffman block followed by an empty stored
+// block, so the output ends on a byte boundary and can be followed by more blocks.
+int DeflateBand( const unsigned char* data, long len, struct membuf* out ) {
+
+  long* head = (long*) malloc( sizeof(long) << DEFLATEHASHBITS );
+  long* prev = (long*) malloc( sizeof(long) * DEFLATEWINDOW );
+  if ( head == NULL || prev == NULL ) {
+    free( prev );
+    free( head );
+    return -1;
+  }
+  long i;
+  for ( i = 0; i < ( 1L << DEFLATEHASHBITS ); i++ )
+    head[i] = -1;
+
+  struct bitwriter bw = { out, 0, 0 };
+  PutBits( &bw, 0, 1 );  // BFINAL = 0
+  PutBits( &bw, 1, 2 );  // BTYPE = 01, fixed Huffman codes
+
+  long pos = 0;
+  while ( pos < len ) {
+    int bestlen = 0;
+    long bestdist = 0;
+
+    if ( pos + 3 <= len ) {
+      unsigned long hash = ( ( (unsigned long) data[pos] << 16 ) | ( data[pos+1] << 8 ) | data[pos+2] ) * 2654435761UL;
+      hash = ( hash >> 8 ) & ( ( 1UL << DEFLATEHASHBITS ) - 1 );
+
+      long maxlen = len - pos < DEFLATEMAXMATCH ? len - pos : DEFLATEMAXMATCH;
+      long candidate = head[hash];
+      int chain = 0;
+      while ( candidate >= 0 && pos - candidate <= DEFLATEWINDOW && chain++ < DEFLATEMAXCHAIN ) {
+        if ( data[candidate + bestlen] == data[pos + bestlen] ) {
+          int l = 0;
+          while ( l < maxlen && data[candidate + l] == data[pos + l] )
+            l++;
+          if ( l > bestlen ) {
+            bestlen = l;
+            bestdist = pos - candidate;
+            if ( l == maxlen )
+              break;
+          }
+        }
+        long next = prev[candidate & ( DEFLATEWINDOW - 1 )];
+        if ( next >= candidate )  // the slot has been reused by a newer position
+          break;
+        candidate = next;
+      }
     }
-    else if ( findnumberparts && !isnumberpart ) {
-      findnumberparts = 0;
-      tempstr[i] = '\0';
-      if ( beglong2 == NULL )
-        findbegin = 1;
+
+    long step = bestlen >= 3 ? bestlen : 1;
+    if ( bestlen >= 3 )
+      PutMatch( &bw, bestlen, bestdist );
+    else
+      PutFixedSymbol( &bw, data[pos] );
+
+    // remember every position passed over
+    for ( ; step > 0; step--, pos++ ) {
+      if ( pos + 3 > len )
+        continue;
+      unsigned long hash = ( ( (unsigned long) data[pos] << 16 ) | ( data[pos+1] << 8 ) | data[pos+2] ) * 2654435761UL;
+      hash = ( hash >> 8 ) & ( ( 1UL << DEFLATEHASHBITS ) - 1 );
+      prev[pos & ( DEFLATEWINDOW - 1 )] = head[hash];
+      head[hash] = pos;
     }
   }
 
-  int fail = 1;
-  if ( beglong1 != NULL && beglong2 != NULL ) {
-    *first  = atol( beglong1 );
-    *second = atol( beglong2 );
-    fail = 0;
+  PutFixedSymbol( &bw, 256 );  // end of block
+
+  PutBits( &bw, 0, 3 );        // empty stored block: BFINAL = 0, BTYPE = 00,
+  PutBits( &bw, 0, 7 );        // padded to a byte boundary,
+  MemAppend( out, "\x00\x00\xFF\xFF", 4 );  // LEN = 0 and NLEN = ~0
+
+  free( prev );
+  free( head );
+  return out->failed ? -1 : 0;
+}
+
+static int Paeth( int a, int b, int c ) {
+
+  int p  = a + b - c;
+  int pa = abs( p - a );
+  int pb = abs( p - b );
+  int pc = abs( p - c );
+  if ( pa <= pb && pa <= pc )
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// Append the PNG scanlines of some rows of pixels, choosing the filter of each row
+// with the usual minimum sum of absolute differences rule.  above is the row before
+// the first one, or NULL.
+void FilterRows( const struct pixel* pixels, const struct pixel* above, long w, long rows, struct membuf* out ) {
+
+  long rowbytes = 3 * w;
+  unsigned char* trial = (unsigned char*) malloc( 4 * rowbytes );
+  if ( trial == NULL ) {
+    out->failed = 1;
+    return;
   }
 
-  free( tempstr );
-  tempstr = NULL;
+  long y;
+  for ( y = 0; y < rows; y++ ) {
+    const unsigned char* cur = (const unsigned char*)( pixels + y * w );
+    const unsigned char* up  = y > 0 ? (const unsigned char*)( pixels + ( y - 1 ) * w ) : (const unsigned char*) above;
 
-  return fail;
+    static const unsigned char filtertype[4] = { 0, 1, 2, 4 };  // none, sub, up, paeth
+    int tries = up != NULL ? 4 : 2;
+    int best = 0;
+    unsigned long bestsum = 0;
+    int f;
+    for ( f = 0; f < tries; f++ ) {
+      unsigned char* row = trial + f * rowbytes;
+      unsigned long sum = 0;
+      long i;
+      for ( i = 0; i < rowbytes; i++ ) {
+        int left = i >= 3 ? cur[i - 3] : 0;
+        int above_ = up != NULL ? up[i] : 0;
+        int upleft = i >= 3 && up != NULL ? up[i - 3] : 0;
+        int predict = 0;
+        if ( filtertype[f] == 1 )
+          predict = left;
+        else if ( filtertype[f] == 2 )
+          predict = above_;
+        else if ( filtertype[f] == 4 )
+          predict = Paeth( left, above_, upleft );
+        row[i] = (unsigned char)( cur[i] - predict );
+        sum += row[i] < 128 ? row[i] : 256 - row[i];
+      }
+      if ( f == 0 || sum < bestsum ) {
+        best = f;
+        bestsum = sum;
+      }
+    }
+
+    MemAppendByte( out, filtertype[best] );
+    MemAppend( out, trial + best * rowbytes, rowbytes );
+  }
+
+  free( trial );
 }
 
-// create a palette
-void initpal( struct pixel holdpal[256] ) {
-  int         i;
+static void AppendPNGChunk( struct membuf* mb, const char* type, const unsigned char* data, long len ) {
 
-  for (i = 0; i < 64; i++) {
-    holdpal[i].red = 125 - i;
-    holdpal[i].green = 61 + i;
-    holdpal[i].blue = 254 - (i * 2);
+  MemAppendBE32( mb, len );
+  MemAppend( mb, type, 4 );
+  if ( len > 0 )
+    MemAppend( mb, data, len );
+  unsigned long crc = Crc32( 0, (const unsigned char*) type, 4 );
+  crc = Crc32( crc, data, len );
+  MemAppendBE32( mb, crc );
+}
+
+static void AppendPNGHeader( struct membuf* mb, long w, long h ) {
+
+  static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+  MemAppend( mb, signature, 8 );
+
+  unsigned char ihdr[13];
+  struct membuf hb = { ihdr, 0, sizeof(ihdr), 0 };
+  MemAppendBE32( &hb, w );
+  MemAppendBE32( &hb, h );
+  ihdr[8]  = 8;   // bit depth
+  ihdr[9]  = 2;   // truecolour
+  ihdr[10] = 0;   // deflate
+  ihdr[11] = 0;   // adaptive filtering
+  ihdr[12] = 0;   // not interlaced
+  AppendPNGChunk( mb, "IHDR", ihdr, 13 );
+}
+
+// The last IDAT (a final empty fixed block and the zlib checksum) and the IEND.
+static void AppendPNGTrailer( struct membuf* mb, unsigned long adler ) {
+
+  unsigned char tail[6] = { 0x03, 0x00,
+                            (unsigned char)( adler >> 24 ), (unsigned char)( adler >> 16 ),
+                            (unsigned char)( adler >> 8 ), (unsigned char) adler };
+  AppendPNGChunk( mb, "IDAT", tail, 6 );
+  AppendPNGChunk( mb, "IEND", NULL, 0 );
+}
+
+static const unsigned char ZlibHeader[2] = { 0x78, 0x01 };
+
+void AppendPPMHeader( struct membuf* mb, long w, long h ) {
+
+  char size[64];
+  sprintf( size, "%ld %ld", w, h );
+
+  MemAppend( mb, "P6", 2 );
+  MemAppend( mb, CRLF, 2 );
+  MemAppend( mb, size, strlen( size ) );
+  MemAppend( mb, CRLF, 2 );
+  MemAppend( mb, "255", 3 );
+  MemAppend( mb, CRLF, 2 );
+}
+
+static void QOIStart( struct qoistate* qs, struct membuf* mb, long w, long h ) {
+
+  memset( qs, 0, sizeof(struct qoistate) );
+  MemAppend( mb, "qoif", 4 );
+  MemAppendBE32( mb, w );
+  MemAppendBE32( mb, h );
+  MemAppendByte( mb, 3 );  // RGB
+  MemAppendByte( mb, 0 );  // sRGB
+}
+
+static void QOIFlushRun( struct qoistate* qs, struct membuf* mb ) {
+
+  if ( qs->run > 0 ) {
+    MemAppendByte( mb, 0xC0 | ( qs->run - 1 ) );
+    qs->run = 0;
   }
+}
 
-  for (i = 64; i < 128; i++) {
-    holdpal[i].red = 61 + (i - 64);
-    holdpal[i].green = 125 + ((i - 64) * 2);
-    holdpal[i].blue = 125 - (i - 64);
+static void QOIEncode( struct qoistate* qs, const struct pixel* pixels, long count, struct membuf* mb ) {
+
+  long i;
+  for ( i = 0; i < count; i++ ) {
+    unsigned char px[3] = { pixels[i].red, pixels[i].green, pixels[i].blue };
+
+    if ( memcmp( px, qs->prev, 3 ) == 0 ) {
+      if ( ++qs->run == 62 )
+        QOIFlushRun( qs, mb );
+      continue;
+    }
+    QOIFlushRun( qs, mb );
+
+    int hash = ( px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11 ) % 64;
+    if ( qs->used[hash] && memcmp( qs->index[hash], px, 3 ) == 0 )
+      MemAppendByte( mb, hash );
+    else {
+      memcpy( qs->index[hash], px, 3 );
+      qs->used[hash] = 1;
+      signed char dr = (signed char)( px[0] - qs->prev[0] );
+      signed char dg = (signed char)( px[1] - qs->prev[1] );
+      signed char db = (signed char)( px[2] - qs->prev[2] );
+      int dr_dg = dr - dg;
+      int db_dg = db - dg;
+      if ( dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1 )
+        MemAppendByte( mb, 0x40 | ( ( dr + 2 ) << 4 ) | ( ( dg + 2 ) << 2 ) | ( db + 2 ) );
+      else if ( dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7 ) {
+        MemAppendByte( mb, 0x80 | ( dg + 32 ) );
+        MemAppendByte( mb, ( ( dr_dg + 8 ) << 4 ) | ( db_dg + 8 ) );
+      }
+      else {
+        MemAppendByte( mb, 0xFE );
+        MemAppend( mb, px, 3 );
+      }
+    }
+    memcpy( qs->prev, px, 3 );
   }
+}
 
-  for (i = 128; i < 192; i++) {
-    holdpal[i].red = 125 + ((i - 128) * 2);
-    holdpal[i].green = 254 - ((i - 128) * 2);
-    holdpal[i].blue = 61 + (i - 128);
+static void QOIFinish( struct qoistate* qs, struct membuf* mb ) {
+
+  QOIFlushRun( qs, mb );
+  MemAppend( mb, "\x00\x00\x00\x00\x00\x00\x00\x01", 8 );
+}
+
+// Start an image that EncodeRows() will add to in order, a few rows at a time.
+void StartImage( struct imageencoder* ie, struct membuf* mb, int format, long w, long h ) {
+
+  memset( ie, 0, sizeof(struct imageencoder) );
+  ie->format = format;
+  ie->w = w;
+  ie->adler = 1;
+  if ( format == IMAGEPNG )
+    AppendPNGHeader( mb, w, h );
+  else if ( format == IMAGEQOI )
+    QOIStart( &ie->qoi, mb, w, h );
+  else
+    AppendPPMHeader( mb, w, h );
+}
+
+// Encode the next rows of the image, above being the row before them (NULL for the first).
+void EncodeRows( struct imageencoder* ie, struct membuf* mb, const struct pixel* pixels, const struct pixel* above, long rows ) {
+
+  if ( ie->format == IMAGEPNG ) {
+    struct membuf filtered = { NULL, 0, 0, 0 };
+    struct membuf deflated = { NULL, 0, 0, 0 };
+    FilterRows( pixels, above, ie->w, rows, &filtered );
+    if ( ie->rows == 0 )
+      MemAppend( &deflated, ZlibHeader, 2 );
+    if ( filtered.failed || DeflateBand( filtered.data, filtered.len, &deflated ) != 0 )
+      mb->failed = 1;
+    AppendPNGChunk( mb, "IDAT", deflated.data, deflated.len );
+    ie->adler = Adler32( ie->adler, filtered.data, filtered.len );
+    free( deflated.data );
+    free( filtered.data );
   }
+  else if ( ie->format == IMAGEQOI )
+    QOIEncode( &ie->qoi, pixels, ie->w * rows, mb );
+  else
+    MemAppend( mb, pixels, sizeof(struct pixel) * ie->w * rows );
+  ie->rows += rows;
+}
 
-  for (i = 192; i < 255; i++) {
-    holdpal[i].red = 254 - ((i - 192) * 2);
-    holdpal[i].green = 125 - (i - 192);
-    holdpal[i].blue = 125 + ((i - 192) * 2);
+void FinishImage( struct imageencoder* ie, struct membuf* mb ) {
+
+  if ( ie->format == IMAGEPNG ) {
+    if ( ie->rows == 0 )
+      AppendPNGChunk( mb, "IDAT", ZlibHeader, 2 );
+    AppendPNGTrailer( mb, ie->adler );
+  }
+  else if ( ie->format == IMAGEQOI )
+    QOIFinish( &ie->qoi, mb );
+}
+
+// The format asked for with -f, or else the one the output file name ends in.
+int ImageFormat( const char* formatname, const char* filename ) {
+
+  const char* name = formatname;
+  if ( name == NULL && filename != NULL ) {
+    name = strrchr( filename, '.' );
+    if ( name != NULL )
+      name++;
   }
+  if ( name != NULL && ( strcmp( name, "png" ) == 0 || strcmp( name, "PNG" ) == 0 ) )
+    return IMAGEPNG;
+  if ( name != NULL && ( strcmp( name, "qoi" ) == 0 || strcmp( name, "QOI" ) == 0 ) )
+    return IMAGEQOI;
+  return IMAGEPPM;
+}
 
-  holdpal[255].red = 0;
-  holdpal[255].green = 0;
-  holdpal[255].blue = 0;
+const char* ImageExtension( int format ) {
+
+  if ( format == IMAGEPNG )
+    return "png";
+  if ( format == IMAGEQOI )
+    return "qoi";
+  return "ppm";
+}
+
+// Encode a whole image held in memory.
+int EncodeImage( struct membuf* mb, int format, const struct pixel* pixels, long w, long h ) {
+
+  struct imageencoder ie;
+  StartImage( &ie, mb, format, w, h );
+  if ( h > 0 )
+    EncodeRows( &ie, mb, pixels, NULL, h );
+  FinishImage( &ie, mb );
+  return mb->failed ? -1 : 0;
+}
+
+int WriteImageFile( const char* filename, int format, const struct pixel* pixels, long w, long h ) {
+
+  struct membuf mb = { NULL, 0, 0, 0 };
+  int failed = EncodeImage( &mb, format, pixels, w, h ) != 0;
+
+  FILE* fp = failed ? NULL : fopen( filename, "wb" );
+  if ( fp == NULL || fwrite( mb.data, 1, mb.len, fp ) != (size_t) mb.len )
+    failed = 1;
+  if ( fp != NULL && fclose( fp ) != 0 )
+    failed = 1;
+
+  free( mb.data );
+  return failed ? -1 : 0;
 }
 
+struct bandresult
+{
+  struct membuf   out;      // encoded band, or raw pixels for PPM and QOI
+  unsigned long   adler;    // of the band's filtered scanlines
+  long            rawlen;
+  int             done;
+};
+
+struct bandstate
+{
+  FILE*               fpout;
+  int                 format;
+  long                w;
+  long                h;
+  void                (*getrows)( void*, long, long, struct pixel* );
+  void*               ctx;
+  long                bandcount;
+  long                nextband;
+  long                nextwrite;
+  struct bandresult*  results;
+  struct imageencoder enc;      // the header, trailer and QOI state; the PNG bands are deflated in parallel
+  int                 failed;
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_t     lock;
+#endif
+};
+
+static void* BandWorker( void* arg ) {
+
+  struct bandstate* bs = (struct bandstate*) arg;
+  struct pixel* pixels = (struct pixel*) malloc( sizeof(struct pixel) * bs->w * ( BANDROWS + 1 ) );
+  if ( pixels == NULL ) {
+    bs->failed = 1;
+    return NULL;
+  }
+
+  long band;
+  while ( !bs->failed && ( band = NextWorkItem( &bs->nextband ) ) < bs->bandcount ) {
+    long y0 = band * BANDROWS;
+    long rows = bs->h - y0 < BANDROWS ? bs->h - y0 : BANDROWS;
+    struct bandresult* br = &bs->results[band];
+
+    if ( bs->format == IMAGEPNG ) {
+      // the row above the band is needed for the up and paeth filters
+      struct pixel* above = NULL;
+      if ( y0 > 0 ) {
+        bs->getrows( bs->ctx, y0 - 1, rows + 1, pixels );
+        above = pixels;
+      }
+      else
+        bs->getrows( bs->ctx, y0, rows, pixels );
+
+      struct membuf filtered = { NULL, 0, 0, 0 };
+      FilterRows( above != NULL ? pixels + bs->w : pixels, above, bs->w, rows, &filtered );
+      if ( band == 0 )
+        MemAppend( &br->out, ZlibHeader, 2 );
+      if ( filtered.failed || DeflateBand( filtered.data, filtered.len, &br->out ) != 0 )
+        bs->failed = 1;
+      br->adler = Adler32( 1, filtered.data, filtered.len );
+      br->rawlen = filtered.len;
+      free( filtered.data );
+    }
+    else {
+      bs->getrows( bs->ctx, y0, rows, pixels );
+      MemAppend( &br->out, pixels, sizeof(struct pixel) * bs->w * rows );
+    }
+    if ( br->out.failed )
+      bs->failed = 1;
+
+    // write out whatever is now next in line
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock( &bs->lock );
+#endif
+    br->done = 1;
+    while ( bs->nextwrite < bs->bandcount && bs->results[bs->nextwrite].done ) {
+      struct bandresult* next = &bs->results[bs->nextwrite];
+      struct membuf chunk = { NULL, 0, 0, 0 };
+      if ( bs->format == IMAGEPNG ) {
+        AppendPNGChunk( &chunk, "IDAT", next->out.data, next->out.len );
+        bs->enc.adler = Adler32Combine( bs->enc.adler, next->adler, next->rawlen );
+      }
+      else if ( bs->format == IMAGEQOI )
+        QOIEncode( &bs->enc.qoi, (const struct pixel*) next->out.data, next->out.len / sizeof(struct pixel), &chunk );
+      long rows = bs->h - bs->nextwrite * BANDROWS;
+      bs->enc.rows += rows < BANDROWS ? rows : BANDROWS;
+      const struct membuf* towrite = bs->format == IMAGEPPM ? &next->out : &chunk;
+      if ( chunk.failed || fwrite( towrite->data, 1, towrite->len, bs->fpout ) != (size_t) towrite->len )
+        bs->failed = 1;
+      free( chunk.data );
+      free( next->out.data );
+      next->out.data = NULL;
+      bs->nextwrite++;
+    }
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock( &bs->lock );
+#endif
+  }
+
+  free( pixels );
+  return NULL;
+}
+
+// Write a w x h image to fpout, getrows( ctx, y0, rows, out ) supplying the pixels
+// a band at a time from several threads.
+int WriteImageBands( FILE* fpout, int format, long w, long h, int threads,
+                     void (*getrows)( void*, long, long, struct pixel* ), void* ctx ) {
+
+  struct bandstate* bs = (struct bandstate*) calloc( 1, sizeof(struct bandstate) );
+  if ( bs == NULL )
+    return -1;
+  bs->fpout = fpout;
+  bs->format = format;
+  bs->w = w;
+  bs->h = h;
+  bs->getrows = getrows;
+  bs->ctx = ctx;
+  bs->bandcount = ( h + BANDROWS - 1 ) / BANDROWS;
+  bs->results = (struct bandresult*) calloc( bs->bandcount > 0 ? bs->bandcount : 1, sizeof(struct bandresult) );
+  if ( bs->results == NULL ) {
+    free( bs );
+    return -1;
+  }
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_init( &bs->lock, NULL );
+#endif
+
+  struct membuf header = { NULL, 0, 0, 0 };
+  StartImage( &bs->enc, &header, format, w, h );
+  if ( header.failed || fwrite( header.data, 1, header.len, fpout ) != (size_t) header.len )
+    bs->failed = 1;
+  free( header.data );
+
+  if ( !bs->failed )
+    RunWorkers( threads, BandWorker, bs );
+
+  struct membuf trailer = { NULL, 0, 0, 0 };
+  FinishImage( &bs->enc, &trailer );
+  if ( trailer.failed || ( trailer.len > 0 && fwrite( trailer.data, 1, trailer.len, fpout ) != (size_t) trailer.len ) )
+    bs->failed = 1;
+  free( trailer.data );
+
+  int failed = bs->failed;
+  long i;
+  for ( i = 0; i < bs->bandcount; i++ )
+    free( bs->results[i].out.data );
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_destroy( &bs->lock );
+#endif
+  free( bs->results );
+  free( bs );
+  return failed ? -1 : 0;
+}
+
+/* Shards.                                                               */
+/*                                                                       */
+/* --shard i/N renders every tile whose number (counting across then     */
+/* down) leaves i over when divided by N.  Interleaving the tiles keeps  */
+/* the slow parts of an image spread across all the shards.  A shard     */
+/* file is a text line that names the shard and the view, followed by    */
+/* its tiles in order, each one TILESIZE wide (less at the right and     */
+/* bottom edges) and stored row by row.  --merge checks that the shard   */
+/* files all belong to the same render and together cover it, then      */
+/* reads them back tile row by tile row into the final image.            */
+
+// The view, as text to compare between checkpoints and shard files.
+void DescribeView( const struct view* v, char* description, int size ) {
+
+  snprintf( description, size, "%d %ld %ld %d %d %.17g %.17g %.17g %.17g %.17g",
+            TILESIZE, v->resolx, v->resoly, v->capk, v->MakeJuliaSet, v->c_r, v->c_i,
+            v->centerx, v->centery, v->zoomlevel );
+}
+
+static void AppendShardHeader( struct membuf* mb, const struct view* v, int shard, int shards ) {
+
+  char description[256];
+  char line[320];
+  DescribeView( v, description, sizeof(description) );
+  snprintf( line, sizeof(line), "fractals shard %d of %d: %s\n", shard, shards, description );
+  MemAppend( mb, line, strlen( line ) );
+}
+
+// Where each tile starts within the pixels of its shard file, and the size of each shard's pixels.
+static void ShardLayout( long resolx, long resoly, int shards, long long* tileoffset, long long* shardsize ) {
+
+  long tilesx = ( resolx + TILESIZE - 1 ) / TILESIZE;
+  long tilesy = ( resoly + TILESIZE - 1 ) / TILESIZE;
+  int i;
+  for ( i = 0; i < shards; i++ )
+    shardsize[i] = 0;
+
+  long tile;
+  for ( tile = 0; tile < tilesx * tilesy; tile++ ) {
+    long x0 = ( tile % tilesx ) * TILESIZE;
+    long y0 = ( tile / tilesx ) * TILESIZE;
+    long w  = resolx - x0 < TILESIZE ? resolx - x0 : TILESIZE;
+    long h  = resoly - y0 < TILESIZE ? resoly - y0 : TILESIZE;
+    tileoffset[tile] = shardsize[tile % shards];
+    shardsize[tile % shards] += (long long) sizeof(struct pixel) * w * h;
+  }
+}
+
+static int SeekFile( FILE* fp, long long offset ) {
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+  return _fseeki64( fp, offset, SEEK_SET );
+#else
+  return fseeko( fp, (off_t) offset, SEEK_SET );
+#endif
+}
+
+struct mergestate
+{
+  FILE**        files;       // by shard number
+  long long*    headerlen;
+  long long*    tileoffset;
+  int           shards;
+  long          resolx;
+  long          resoly;
+  long          tilesx;
+  int           failed;
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_t   lock;    // the image is encoded in parallel, but read one piece at a time
+#endif
+};
+
+// Fetch rows y0 to y0 + rows - 1 of the merged image from the shard files.
+static void MergeRows( void* ctx, long y0, long rows, struct pixel* out ) {
+
+  struct mergestate* ms = (struct mergestate*) ctx;
+  struct pixel piece[TILESIZE * TILESIZE];
+
+  long y = y0;
+  while ( y < y0 + rows ) {
+    long ty = y / TILESIZE;
+    long h  = ms->resoly - ty * TILESIZE < TILESIZE ? ms->resoly - ty * TILESIZE : TILESIZE;
+    long end = ty * TILESIZE + h < y0 + rows ? ty * TILESIZE + h : y0 + rows;
+
+    long tx;
+    for ( tx = 0; tx < ms->tilesx; tx++ ) {
+      long tile = ty * ms->tilesx + tx;
+      int shard = tile % ms->shards;
+      long x0 = tx * TILESIZE;
+      long w  = ms->resolx - x0 < TILESIZE ? ms->resolx - x0 : TILESIZE;
+      long long offset = ms->headerlen[shard] + ms->tileoffset[tile]
+                         + (long long) sizeof(struct pixel) * w * ( y - ty * TILESIZE );
+
+#if defined(HAVE_PTHREADS)
+      pthread_mutex_lock( &ms->lock );
+#endif
+      if ( SeekFile( ms->files[shard], offset ) != 0
+           || fread( piece, sizeof(struct pixel) * w, end - y, ms->files[shard] ) != (size_t)( end - y ) ) {
+        ms->failed = 1;
+        memset( piece, 0, sizeof(piece) );
+      }
+#if defined(HAVE_PTHREADS)
+      pthread_mutex_unlock( &ms->lock );
+#endif
+
+      long row;
+      for ( row = 0; row < end - y; row++ )
+        memcpy( &out[( y - y0 + row ) * ms->resolx + x0], &piece[row * w], sizeof(struct pixel) * w );
+    }
+    y = end;
+  }
+}
+
+// Assemble the shard files named on the command line into fp.
+int RunMerge( const struct options* opt, int threads, FILE* fp, int format ) {
+
+  int count = opt->inputcount;
+  if ( count == 0 ) {
+    fprintf( stderr, "Error: No shard files to merge.\n" );
+    return -1;
+  }
+
+  struct mergestate ms;
+  memset( &ms, 0, sizeof(ms) );
+  ms.shards = count;
+  ms.files = (FILE**) calloc( count, sizeof(FILE*) );
+  ms.headerlen = (long long*) calloc( count, sizeof(long long) );
+  int failed = ms.files == NULL || ms.headerlen == NULL;
+
+  char description[256] = "";
+  int i;
+  for ( i = 0; i < count && !failed; i++ ) {
+    const char* name = opt->inputfiles[i];
+    char line[320];
+    int shard, shards, skip = 0;
+
+    // a shard whose render was stopped still has its checkpoint
+    char* checkpointpath = (char*) malloc( strlen( name ) + 6 );
+    if ( checkpointpath != NULL ) {
+      sprintf( checkpointpath, "%s.ckpt", name );
+      FILE* fdtest = fopen( checkpointpath, "rb" );
+      if ( fdtest != NULL ) {
+        fprintf( stderr, "Error: The shard \"%s\" is not finished.\n", name );
+        fclose( fdtest );
+        failed = 1;
+      }
+      free( checkpointpath );
+    }
+
+    FILE* in = failed ? NULL : fopen( name, "rb" );
+    if ( !failed && ( in == NULL || fgets( line, sizeof(line), in ) == NULL
+                      || sscanf( line, "fractals shard %d of %d: %n", &shard, &shards, &skip ) < 2 || skip == 0 ) ) {
+      fprintf( stderr, "Error: \"%s\" is not a shard file.\n", name );
+      failed = 1;
+    }
+    else if ( !failed && ( shards != count || shard < 0 || shard >= count || ms.files[shard] != NULL ) ) {
+      fprintf( stderr, "Error: \"%s\" is shard %d of %d, which doesn't fit with the other %d files.\n",
+               name, shard, shards, count - 1 );
+      failed = 1;
+    }
+    else if ( !failed && i > 0 && strcmp( description, line + skip ) != 0 ) {
+      fprintf( stderr, "Error: \"%s\" is a shard of a different render.\n", name );
+      failed = 1;
+    }
+    if ( failed ) {
+      if ( in != NULL )
+        fclose( in );
+      break;
+    }
+
+    snprintf( description, sizeof(description), "%s", line + skip );
+    ms.files[shard] = in;
+    ms.headerlen[shard] = strlen( line );
+  }
+
+  int tilesize = 0;
+  if ( !failed && ( sscanf( description, "%d %ld %ld", &tilesize, &ms.resolx, &ms.resoly ) != 3
+                    || tilesize != TILESIZE || ms.resolx <= 0 || ms.resoly <= 0 ) ) {
+    fprintf( stderr, "Error: The shards were rendered with a different tile size.\n" );
+    failed = 1;
+  }
+
+  long tilecount = 0;
+  if ( !failed ) {
+    ms.tilesx = ( ms.resolx + TILESIZE - 1 ) / TILESIZE;
+    tilecount = ms.tilesx * ( ( ms.resoly + TILESIZE - 1 ) / TILESIZE );
+    ms.tileoffset = (long long*) malloc( sizeof(long long) * tilecount );
+    long long* shardsize = (long long*) malloc( sizeof(long long) * count );
+    if ( ms.tileoffset == NULL || shardsize == NULL )
+      failed = 1;
+    else
+      ShardLayout( ms.resolx, ms.resoly, count, ms.tileoffset, shardsize );
+    free( shardsize );
+  }
+
+  if ( !failed ) {
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_init( &ms.lock, NULL );
+#endif
+    failed = WriteImageBands( fp, format, ms.resolx, ms.resoly, threads, MergeRows, &ms ) != 0 || ms.failed;
+    if ( ms.failed )
+      fprintf( stderr, "Error: A shard file is shorter than it should be.\n" );
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_destroy( &ms.lock );
+#endif
+  }
+
+  for ( i = 0; i < count && ms.files != NULL; i++ )
+    if ( ms.files[i] != NULL )
+      fclose( ms.files[i] );
+  free( ms.files );
+  free( ms.headerlen );
+  free( ms.tileoffset );
+  return failed ? -1 : 0;
+}
+
+/* Equalized streaming.                                                  */
+/*                                                                       */
+/* Equalized colors need the histogram of the whole image before the     */
+/* first pixel can be colored, so a plain --equalize render takes two    */
+/* passes.  The first renders the image a band of TILESIZE rows at a     */
+/* time, adding each band's k to the histogram and spilling them to a    */
+/* temporary file, in two bytes a pixel when capk allows it.  The second */
+/* reads the bands back in order, colors them with the equalized map and */
+/* writes them out the usual way.  Only a band per thread is ever in     */
+/* memory, so the image can be far larger than RAM, as long as there is  */
+/* disk for the spill file.                                              */
+
+struct spillstate
+{
+  const struct view*      v;
+  const struct colormap*  cm;
+  FILE*         spill;
+  int           spillsize;   // bytes per k in the spill file
+  long          nextband;
+  long          bandcount;
+  long long*    hist;        // pixels with each k from 0 to capk - 1
+  int           failed;
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_t   lock;    // the spill file is read and written one band at a time
+#endif
+};
+
+static void* SpillWorker( void* arg ) {
+
+  struct spillstate* ss = (struct spillstate*) arg;
+  const struct view* v = ss->v;
+  long resolx = v->resolx;
+  int capk = v->capk;
+
+  long long* hist = (long long*) calloc( capk > 0 ? capk : 1, sizeof(long long) );
+  int* kbuf = (int*) malloc( sizeof(int) * resolx * TILESIZE );
+  unsigned short* packed = (unsigned short*) malloc( sizeof(unsigned short) * resolx * TILESIZE );
+  int failed = hist == NULL || kbuf == NULL || packed == NULL;
+
+  long band;
+  while ( !failed && ( band = NextWorkItem( &ss->nextband ) ) < ss->bandcount ) {
+    long y0 = band * TILESIZE;
+    long rows = v->resoly - y0 < TILESIZE ? v->resoly - y0 : TILESIZE;
+    long count = resolx * rows;
+    RenderTile( v, 0, y0, resolx, rows, kbuf );
+
+    long i;
+    for ( i = 0; i < count; i++ )
+      if ( kbuf[i] < capk )
+        hist[kbuf[i]]++;
+    const void* out = kbuf;
+    if ( ss->spillsize == sizeof(unsigned short) ) {
+      for ( i = 0; i < count; i++ )
+        packed[i] = (unsigned short) kbuf[i];
+      out = packed;
+    }
+
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock( &ss->lock );
+#endif
+    failed = SeekFile( ss->spill, (long long) ss->spillsize * resolx * y0 ) != 0
+             || fwrite( out, ss->spillsize, count, ss->spill ) != (size_t) count;
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock( &ss->lock );
+#endif
+  }
+
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_lock( &ss->lock );
+#endif
+  if ( failed )
+    ss->failed = 1;
+  else {
+    int k;
+    for ( k = 0; k < capk; k++ )
+      ss->hist[k] += hist[k];
+  }
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_unlock( &ss->lock );
+#endif
+
+  free( hist );
+  free( kbuf );
+  free( packed );
+  return NULL;
+}
+
+// Supplies the rows of the second pass to WriteImageBands(), from the spill file.
+static void SpillRows( void* ctx, long y0, long rows, struct pixel* out ) {
+
+  struct spillstate* ss = (struct spillstate*) ctx;
+  long count = ss->v->resolx * rows;
+  int* kbuf = (int*) malloc( sizeof(int) * count );
+  unsigned short* packed = (unsigned short*) malloc( sizeof(unsigned short) * count );
+  void* in = ss->spillsize == sizeof(unsigned short) ? (void*) packed : (void*) kbuf;
+
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_lock( &ss->lock );
+#endif
+  int failed = kbuf == NULL || packed == NULL
+               || SeekFile( ss->spill, (long long) ss->spillsize * ss->v->resolx * y0 ) != 0
+               || fread( in, ss->spillsize, count, ss->spill ) != (size_t) count;
+  if ( failed )
+    ss->failed = 1;
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_unlock( &ss->lock );
+#endif
+
+  if ( failed )
+    memset( out, 0, sizeof(struct pixel) * count );
+  else {
+    long i;
+    if ( in == packed )
+      for ( i = 0; i < count; i++ )
+        kbuf[i] = packed[i];
+    ColorPixels( kbuf, count, ss->cm, out );
+  }
+  free( kbuf );
+  free( packed );
+}
+
+// Render v with equalized colors and write it to fp, spilling the iteration counts to
+// spillpath (removed afterwards) or, if that is NULL, to an anonymous temporary file.
+int RenderEqualized( const struct view* v, const struct palette* pal, int threads, FILE* fp, int format,
+                     const char* spillpath ) {
+
+  struct spillstate ss;
+  memset( &ss, 0, sizeof(ss) );
+  ss.v = v;
+  ss.spillsize = v->capk <= 65535 ? sizeof(unsigned short) : sizeof(int);
+  ss.bandcount = ( v->resoly + TILESIZE - 1 ) / TILESIZE;
+  ss.hist = (long long*) calloc( v->capk > 0 ? v->capk : 1, sizeof(long long) );
+  ss.spill = spillpath != NULL ? fopen( spillpath, "w+b" ) : tmpfile();
+  if ( ss.hist == NULL || ss.spill == NULL ) {
+    fprintf( stderr, "Error: Could not make a temporary file for the iteration counts.\n" );
+    if ( ss.spill != NULL )
+      fclose( ss.spill );
+    if ( spillpath != NULL )
+      remove( spillpath );
+    free( ss.hist );
+    return -1;
+  }
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_init( &ss.lock, NULL );
+#endif
+
+  RunWorkers( threads, SpillWorker, &ss );
+
+  struct colormap cm;
+  int failed = ss.failed || fflush( ss.spill ) != 0;
+  if ( failed )
+    fprintf( stderr, "Error: Could not write the iteration counts to the temporary file.\n" );
+  else if ( MakeEqualizedColorMap( pal, v->capk, ss.hist, &cm ) != 0 )
+    failed = 1;
+  else {
+    ss.cm = &cm;
+    failed = WriteImageBands( fp, format, v->resolx, v->resoly, threads, SpillRows, &ss ) != 0;
+    if ( ss.failed )
+      fprintf( stderr, "Error: Could not read the iteration counts back from the temporary file.\n" );
+    failed = failed || ss.failed;
+    FreeColorMap( &cm );
+  }
+
+  fclose( ss.spill );
+  if ( spillpath != NULL )
+    remove( spillpath );
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_destroy( &ss.lock );
+#endif
+  free( ss.hist );
+  return failed ? -1 : 0;
+}
+
+/* Saved orbits.                                                         */
+/*                                                                       */
+/* --save-orbits keeps the k and z of every pixel that was colored as    */
+/* reaching the cap in a file next to the image.  Pixels that escaped    */
+/* keep their colors at any higher cap, so --continue-to only carries on */
+/* with the saved orbits and repaints the ones that now escape.  The     */
+/* .ppm is updated in place and the orbits file is replaced with the     */
+/* ones still going, so the render can be taken further again later.    */
+/* The image ends up the same as a render with -m set to the new cap.    */
+
+struct savedorbit
+{
+  long long   pixel;
+  double      z[2];
+  int         k;
+  int         unused;
+};
+
+// Save those of the count orbits in os that are colored as reaching capk, in pixel order.
+int WriteOrbits( const char* path, const struct orbitstate* os, long count, int capk ) {
+
+  struct view v = *os->v;
+  v.capk = capk;
+  char description[256];
+  DescribeView( &v, description, sizeof(description) );
+
+  long saved = 0;
+  long s;
+  for ( s = 0; s < count; s++ )
+    if ( !OrbitEscaped( os, s ) || os->k[s] == capk )
+      saved++;
+
+  char* temppath = (char*) malloc( strlen( path ) + 5 );
+  if ( temppath == NULL )
+    return -1;
+  sprintf( temppath, "%s.tmp", path );
+  FILE* fp = fopen( temppath, "wb" );
+  if ( fp == NULL ) {
+    free( temppath );
+    return -1;
+  }
+
+  int failed = fprintf( fp, "fractals orbits %s %ld\n", description, saved ) < 0;
+  long i;
+  for ( i = 0; i < count && !failed; i++ ) {
+    s = os->pixel != NULL ? i : TiledIndex( v.resolx, v.resoly, i % v.resolx, i / v.resolx );
+    if ( !OrbitEscaped( os, s ) || os->k[s] == capk ) {
+      struct savedorbit so;
+      so.pixel = os->pixel != NULL ? os->pixel[s] : i;
+      so.z[0] = os->z[2 * s];
+      so.z[1] = os->z[2 * s + 1];
+      so.k = os->k[s];
+      so.unused = 0;
+      failed = fwrite( &so, sizeof(so), 1, fp ) != 1;
+    }
+  }
+  failed |= fclose( fp ) != 0;
+
+  // replace the old orbits only once the new ones are all written
+  if ( !failed && rename( temppath, path ) != 0 ) {
+    remove( path );
+    failed = rename( temppath, path ) != 0;
+  }
+  if ( failed )
+    remove( temppath );
+  free( temppath );
+  return failed ? -1 : 0;
+}
+
+// --continue-to: carry on with the orbits saved next to the .ppm given with -o.
+int RunContinue( const struct options* opt, int threads ) {
+
+  const char* filename = opt->userfilename;
+  if ( filename == NULL ) {
+    fprintf( stderr, "Error: --continue-to needs -o and the .ppm file to carry on with.\n" );
+    return -1;
+  }
+  if ( opt->equalize ) {
+    fprintf( stderr, "Error: An equalized image can't be carried on with, since every color would change.\n" );
+    return -1;
+  }
+
+  char* orbitspath = (char*) malloc( strlen( filename ) + 8 );
+  if ( orbitspath == NULL )
+    return -1;
+  sprintf( orbitspath, "%s.orbits", filename );
+  FILE* in = fopen( orbitspath, "rb" );
+  if ( in == NULL ) {
+    fprintf( stderr, "Error: There are no saved orbits in \"%s\".\n", orbitspath );
+    free( orbitspath );
+    return -1;
+  }
+
+  // the view comes from the orbits file, and only the cap from the command line
+  struct options saved;
+  memset( &saved, 0, sizeof(saved) );
+  char line[400];
+  int tilesize, oldcapk;
+  long count = 0;
+  int failed = fgets( line, sizeof(line), in ) == NULL
+               || sscanf( line, "fractals orbits %d %ld %ld %d %d %lf %lf %lf %lf %lf %ld", &tilesize,
+                          &saved.user_resolx, &saved.user_resoly, &oldcapk, &saved.MakeJuliaSet,
+                          &saved.user_julia_r, &saved.user_julia_i, &saved.user_centerx, &saved.user_centery,
+                          &saved.user_zoomlevel, &count ) != 11
+               || saved.user_resolx <= 0 || saved.user_resoly <= 0 || count < 0;
+  if ( failed )
+    fprintf( stderr, "Error: \"%s\" is not an orbits file.\n", orbitspath );
+
+  struct view v;
+  if ( !failed ) {
+    saved.user_resolutionoverride = 1;
+    saved.user_centeroverride = 1;
+    saved.user_capk = opt->user_continueto;
+    saved.deterministic = opt->deterministic;
+    SetupView( &saved, &v );
+    if ( v.capk != opt->user_continueto || v.capk <= oldcapk ) {
+      fprintf( stderr, "Error: The orbits already go to %d iterations.\n", oldcapk );
+      failed = 1;
+    }
+  }
+
+  struct orbitstate os;
+  memset( &os, 0, sizeof(os) );
+  os.v = &v;
+  if ( !failed ) {
+    os.k = (int*) malloc( sizeof(int) * ( count + 1 ) );
+    os.z = (double*) malloc( sizeof(double) * 2 * ( count + 1 ) );
+    os.pixel = (long*) malloc( sizeof(long) * ( count + 1 ) );
+    failed = os.k == NULL || os.z == NULL || os.pixel == NULL;
+  }
+
+  long s;
+  for ( s = 0; s < count && !failed; s++ ) {
+    struct savedorbit so;
+    failed = fread( &so, sizeof(so), 1, in ) != 1 || so.pixel < 0 || so.pixel >= v.resolx * v.resoly;
+    if ( failed )
+      fprintf( stderr, "Error: The orbits in \"%s\" are cut short.\n", orbitspath );
+    else {
+      os.pixel[s] = (long) so.pixel;
+      os.z[2 * s] = so.z[0];
+      os.z[2 * s + 1] = so.z[1];
+      os.k[s] = so.k;
+    }
+  }
+  fclose( in );
+
+  long escaped = 0;
+  if ( !failed )
+    escaped = ContinueOrbits( &os, NULL, count, v.capk, threads );
+
+  // repaint the image, a row at a time
+  FILE* fp = failed ? NULL : fopen( filename, "r+b" );
+  struct membuf header = { NULL, 0, 0, 0 };
+  struct pixel* row = NULL;
+  if ( !failed ) {
+    AppendPPMHeader( &header, v.resolx, v.resoly );
+    row = (struct pixel*) malloc( sizeof(struct pixel) * v.resolx );
+    char* found = (char*) malloc( header.len + 1 );
+    failed = fp == NULL || header.failed || row == NULL || found == NULL
+             || fread( found, 1, header.len, fp ) != (size_t) header.len
+             || memcmp( found, header.data, header.len ) != 0;
+    free( found );
+    if ( failed )
+      fprintf( stderr, "Error: \"%s\" is not the .ppm the orbits were saved with.\n", filename );
+  }
+
+  struct palette pal;
+  struct colormap cm = { NULL, 0, 0 };
+  if ( !failed )
+    failed = OptionPalette( opt, &pal ) != 0;
+  if ( !failed ) {
+    failed = MakeColorMap( &pal, v.capk, &cm ) != 0;
+    FreePalette( &pal );
+  }
+  for ( s = 0; s < count && !failed; ) {
+    long y = os.pixel[s] / v.resolx;
+    long long offset = header.len + (long long) sizeof(struct pixel) * v.resolx * y;
+    failed = SeekFile( fp, offset ) != 0 || fread( row, sizeof(struct pixel), v.resolx, fp ) != (size_t) v.resolx;
+    for ( ; !failed && s < count && os.pixel[s] / v.resolx == y; s++ ) {
+      int k = OrbitEscaped( &os, s ) ? os.k[s] : v.capk;
+      ColorPixels( &k, 1, &cm, &row[os.pixel[s] % v.resolx] );
+    }
+    if ( !failed )
+      failed = SeekFile( fp, offset ) != 0 || fwrite( row, sizeof(struct pixel), v.resolx, fp ) != (size_t) v.resolx;
+    if ( failed )
+      fprintf( stderr, "Error: Could not update \"%s\".\n", filename );
+  }
+  if ( fp != NULL && fclose( fp ) != 0 )
+    failed = 1;
+
+  if ( !failed ) {
+    fprintf( stderr, "%ld of %ld orbits escaped between %d and %d iterations.\n", escaped, count, oldcapk, v.capk );
+    if ( WriteOrbits( orbitspath, &os, count, v.capk ) != 0 ) {
+      fprintf( stderr, "Error: Could not save the orbits to \"%s\".\n", orbitspath );
+      failed = 1;
+    }
+  }
+
+  FreeColorMap( &cm );
+  free( header.data );
+  free( row );
+  free( os.k );
+  free( os.z );
+  free( os.pixel );
+  free( orbitspath );
+  return failed ? -1 : 0;
+}
+
+/* Memory mapped PPM output.                                             */
+/*                                                                       */
+/* When the PPM goes to a file, the file is sized for the whole image up */
+/* front and mapped into memory.  Worker threads render TILESIZE square  */
+/* tiles and colour them straight into their place in the mapping, so    */
+/* there is no separate framebuffer and no ordered write phase: tiles    */
+/* land in the file in whatever order they finish.                       */
+/*                                                                       */
+/* Since the file always holds every finished tile, a long render only   */
+/* has to remember which tiles those are to survive being killed.  A     */
+/* checkpoint file next to the image records the view and a bitmap of   */
+/* finished tiles.  Every CHECKPOINTSECONDS one worker flushes the       */
+/* mapping with msync() and then replaces the checkpoint, so a tile is   */
+/* only ever listed once its pixels are on disk.  That costs a few small */
+/* writes a minute, far below 1% of a render long enough to need it.     */
+/* --resume renders just the tiles that are missing from the bitmap, and */
+/* the checkpoint is removed once the image is complete.                 */
+
+#if defined(HAVE_MMAP)
+
+struct mappedstate
+{
+  const struct view*    v;
+  const struct colormap* cm;
+  unsigned char*        map;
+  off_t                 mapsize;
+  unsigned char*        pixels;     // first pixel byte in the mapping
+  long                  tilesx;
+  long                  tilecount;
+  long long*            tileoffset; // where each tile starts in a shard file, or NULL for a whole image
+  int                   shard;
+  int                   shards;
+  long*                 todo;       // the tiles still to render
+  long                  todocount;
+  long                  nexttile;
+  unsigned char*        done;       // one byte per tile, set once it is in the mapping
+  const char*           checkpointpath;
+  double                nextcheckpoint;
+  pthread_mutex_t       checkpointlock;
+  int                   failed;
+};
+
+// The first line of a checkpoint, which has to match for a resume.
+static void CheckpointHeader( const struct mappedstate* ms, char* header, int size ) {
+
+  char description[256];
+  DescribeView( ms->v, description, sizeof(description) );
+  snprintf( header, size, "fractals checkpoint %s %d %d %ld\n", description, ms->shard, ms->shards, ms->tilecount );
+}
+
+// Flush the finished tiles to disk, then record them.  The new checkpoint
+// is written alongside and renamed over the old one, so there is always
+// a complete checkpoint to resume from.
+static int WriteCheckpoint( struct mappedstate* ms ) {
+
+  long bytes = ( ms->tilecount + 7 ) / 8;
+  unsigned char* bits = (unsigned char*) calloc( bytes, 1 );
+  char* temppath = (char*) malloc( strlen( ms->checkpointpath ) + 5 );
+  if ( bits == NULL || temppath == NULL ) {
+    free( bits );
+    free( temppath );
+    return -1;
+  }
+
+  // the bitmap is taken before the flush, so every tile in it is flushed
+  long tile;
+  for ( tile = 0; tile < ms->tilecount; tile++ )
+    if ( ms->done[tile] )
+      bits[tile / 8] |= 1 << ( tile % 8 );
+  __sync_synchronize();
+
+  int failed = msync( ms->map, ms->mapsize, MS_SYNC ) != 0;
+
+  char header[512];
+  CheckpointHeader( ms, header, sizeof(header) );
+  sprintf( temppath, "%s.tmp", ms->checkpointpath );
+  FILE* fp = failed ? NULL : fopen( temppath, "wb" );
+  if ( fp != NULL ) {
+    failed = fputs( header, fp ) < 0 || fwrite( bits, 1, bytes, fp ) != (size_t) bytes;
+    failed |= fflush( fp ) != 0 || fsync( fileno( fp ) ) != 0;
+    failed |= fclose( fp ) != 0;
+    if ( !failed )
+      failed = rename( temppath, ms->checkpointpath ) != 0;
+    else
+      remove( temppath );
+  }
+  else
+    failed = 1;
+
+  free( bits );
+  free( temppath );
+  return failed ? -1 : 0;
+}
+
+// Mark the tiles listed in the checkpoint as done.
+static int ReadCheckpoint( struct mappedstate* ms ) {
+
+  char header[512];
+  CheckpointHeader( ms, header, sizeof(header) );
+  long headerlen = strlen( header );
+  long bytes = ( ms->tilecount + 7 ) / 8;
+
+  FILE* fp = fopen( ms->checkpointpath, "rb" );
+  if ( fp == NULL )
+    return -1;
+  char* saved = (char*) malloc( headerlen + bytes );
+  int failed = saved == NULL || fread( saved, 1, headerlen + bytes, fp ) != (size_t)( headerlen + bytes );
+  fclose( fp );
+
+  if ( !failed && memcmp( saved, header, headerlen ) != 0 ) {
+    fprintf( stderr, "The checkpoint \"%s\" is for a different render.\n", ms->checkpointpath );
+    failed = 1;
+  }
+
+  long tile;
+  if ( !failed )
+    for ( tile = 0; tile < ms->tilecount; tile++ )
+      ms->done[tile] = ( saved[headerlen + tile / 8] >> ( tile % 8 ) ) & 1;
+
+  free( saved );
+  return failed ? -1 : 0;
+}
+
+static void* MappedWorker( void* arg ) {
+
+  struct mappedstate* ms = (struct mappedstate*) arg;
+  const struct view* v = ms->v;
+  int* kbuf = (int*) malloc( sizeof(int) * TILESIZE * TILESIZE );
+  if ( kbuf == NULL ) {
+    ms->failed = 1;
+    return NULL;
+  }
+
+  long item;
+  while ( !ms->failed && ( item = NextWorkItem( &ms->nexttile ) ) < ms->todocount ) {
+    long tile = ms->todo[item];
+    long x0 = ( tile % ms->tilesx ) * TILESIZE;
+    long y0 = ( tile / ms->tilesx ) * TILESIZE;
+    long w  = v->resolx - x0 < TILESIZE ? v->resolx - x0 : TILESIZE;
+    long h  = v->resoly - y0 < TILESIZE ? v->resoly - y0 : TILESIZE;
+
+    RenderTile( v, x0, y0, w, h, kbuf );
+
+    // a shard file holds each of its tiles in one piece
+    if ( ms->tileoffset != NULL )
+      ColorPixels( kbuf, w * h, ms->cm, (struct pixel*)( ms->pixels + ms->tileoffset[tile] ) );
+    else {
+      long y;
+      for ( y = 0; y < h; y++ ) {
+        struct pixel* dest = (struct pixel*)( ms->pixels + sizeof(struct pixel) * ( ( y0 + y ) * v->resolx + x0 ) );
+        ColorPixels( &kbuf[y * w], w, ms->cm, dest );
+      }
+    }
+    __sync_synchronize();
+    ms->done[tile] = 1;
+
+    // whichever worker notices first takes the checkpoint, the rest carry on
+    if ( ms->checkpointpath != NULL && pthread_mutex_trylock( &ms->checkpointlock ) == 0 ) {
+      if ( WallSeconds() >= ms->nextcheckpoint ) {
+        if ( WriteCheckpoint( ms ) != 0 )
+          fprintf( stderr, "Warning: Could not write the checkpoint \"%s\".\n", ms->checkpointpath );
+        ms->nextcheckpoint = WallSeconds() + CHECKPOINTSECONDS;
+      }
+      pthread_mutex_unlock( &ms->checkpointlock );
+    }
+  }
+
+  free( kbuf );
+  return NULL;
+}
+
+// Render straight into the PPM file fp, which must be a new, empty, regular file,
+// or with resume set, the file of an earlier run that left the checkpoint behind.
+// With shards > 0, only shard's tiles are rendered, into a shard file instead.
+// Returns 1 if the file can't be mapped and it should be written the usual way.
+int RenderMappedPPM( FILE* fp, const struct view* v, const struct colormap* cm, int threads,
+                     const char* checkpointpath, int resume, int shard, int shards ) {
+
+  int fd = fileno( fp );
+  struct stat sb;
+  if ( fd < 0 || fstat( fd, &sb ) != 0 || !S_ISREG( sb.st_mode ) )
+    return 1;
+
+  long tilesx = ( v->resolx + TILESIZE - 1 ) / TILESIZE;
+  long tilecount = tilesx * ( ( v->resoly + TILESIZE - 1 ) / TILESIZE );
+  long long* tileoffset = NULL;
+  long long* shardsize = NULL;
+  struct membuf header = { NULL, 0, 0, 0 };
+  off_t filesize;
+  if ( shards > 0 ) {
+    tileoffset = (long long*) malloc( sizeof(long long) * tilecount );
+    shardsize = (long long*) malloc( sizeof(long long) * shards );
+    if ( tileoffset == NULL || shardsize == NULL ) {
+      free( tileoffset );
+      free( shardsize );
+      return -1;
+    }
+    ShardLayout( v->resolx, v->resoly, shards, tileoffset, shardsize );
+    AppendShardHeader( &header, v, shard, shards );
+    filesize = header.len + (off_t) shardsize[shard];
+    free( shardsize );
+  }
+  else {
+    AppendPPMHeader( &header, v->resolx, v->resoly );
+    filesize = header.len + (off_t) sizeof(struct pixel) * v->resolx * v->resoly;
+  }
+  if ( header.failed ) {
+    free( tileoffset );
+    return -1;
+  }
+  if ( resume && sb.st_size != filesize ) {
+    fprintf( stderr, "The image file does not match the checkpoint.\n" );
+    free( header.data );
+    free( tileoffset );
+    return -1;
+  }
+
+  // reserve the blocks now so a full disk is an error here rather than a SIGBUS later
+  int err = posix_fallocate( fd, 0, filesize );
+  if ( err != 0 && ( ( err != EINVAL && err != EOPNOTSUPP ) || ftruncate( fd, filesize ) != 0 ) ) {
+    free( header.data );
+    free( tileoffset );
+    return -1;
+  }
+
+  unsigned char* map = (unsigned char*) mmap( NULL, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if ( map == MAP_FAILED ) {
+    free( header.data );
+    free( tileoffset );
+    return resume || ftruncate( fd, 0 ) == 0 ? 1 : -1;
+  }
+  memcpy( map, header.data, header.len );
+
+  struct mappedstate ms;
+  memset( &ms, 0, sizeof(ms) );
+  ms.v = v;
+  ms.cm = cm;
+  ms.map = map;
+  ms.mapsize = filesize;
+  ms.pixels = map + header.len;
+  ms.tilesx = tilesx;
+  ms.tilecount = tilecount;
+  ms.tileoffset = tileoffset;
+  ms.shard = shard;
+  ms.shards = shards;
+  ms.checkpointpath = checkpointpath;
+  pthread_mutex_init( &ms.checkpointlock, NULL );
+  free( header.data );
+
+  ms.done = (unsigned char*) calloc( ms.tilecount, 1 );
+  ms.todo = (long*) malloc( sizeof(long) * ms.tilecount );
+  if ( ms.done == NULL || ms.todo == NULL )
+    ms.failed = 1;
+  else if ( resume )
+    ms.failed = ReadCheckpoint( &ms ) != 0;
+
+  long tile;
+  if ( !ms.failed ) {
+    for ( tile = 0; tile < ms.tilecount; tile++ )
+      if ( !ms.done[tile] && ( shards == 0 || tile % shards == shard ) )
+        ms.todo[ms.todocount++] = tile;
+    if ( resume )
+      fprintf( stderr, "Resuming with %ld tiles left to do.\n", ms.todocount );
+  }
+
+  // an empty checkpoint up front means even an early kill can be resumed
+  if ( !ms.failed && checkpointpath != NULL && !resume && WriteCheckpoint( &ms ) != 0 )
+    fprintf( stderr, "Warning: Could not write the checkpoint \"%s\".\n", checkpointpath );
+  ms.nextcheckpoint = WallSeconds() + CHECKPOINTSECONDS;
+
+  if ( !ms.failed )
+    RunWorkers( threads, MappedWorker, &ms );
+
+  if ( munmap( map, filesize ) != 0 )
+    ms.failed = 1;
+  if ( !ms.failed && checkpointpath != NULL )
+    remove( checkpointpath );
+
+  pthread_mutex_destroy( &ms.checkpointlock );
+  free( ms.done );
+  free( ms.todo );
+  free( tileoffset );
+  return ms.failed ? -1 : 0;
+}
+
+#else
+
+int RenderMappedPPM( FILE* fp, const struct view* v, const struct colormap* cm, int threads,
+                     const char* checkpointpath, int resume, int shard, int shards ) {
+
+  return 1;
+}
+
+#endif
+
+void printusage() {
+  printf( "\n" );
+  printf( "fractals version %s\n\n", VersionStr );
+
+  printf( "usage: fractals [options]\n\n" );
+
+  printf( "options:\n" );
+  printf( "  --adaptive          -- start with a low maximum # of iterations and raise\n" );
+  printf( "                         it, up to -m, only for the pixels next to ones\n" );
+  printf( "                         that escaped, until no more escape.\n" );
+  printf( "  --border-fill       -- with -T, fill the tiles deep inside the set from\n" );
+  printf( "                         their border alone instead of iterating every\n" );
+  printf( "                         pixel.  Faster, but a heuristic that can miss a\n" );
+  printf( "                         filament thinner than a pixel.\n" );
+  printf( "  -c real_x,real_y    -- specifies the center coordinates (real_x,real_y).\n" );
+  printf( "  --continue-to int   -- take the .ppm file given with -o, rendered with\n" );
+  printf( "                         --save-orbits, up to this maximum # of iterations.\n" );
+  printf( "  -d socket           -- run as a daemon serving render requests on the unix\n" );
+  printf( "                         domain socket \"socket\".\n" );
+  printf( "  -D socket           -- have the daemon listening on \"socket\" do the render.\n" );
+  printf( "  --deterministic     -- render the same bits on any machine, compiler or\n" );
+  printf( "                         number of threads, a little slower for some Julia\n" );
+  printf( "                         Sets.\n" );
+  printf( "  --equalize          -- color the points that escape by how many others\n" );
+  printf( "                         escaped sooner, so each color covers about the\n" );
+  printf( "                         same area.\n" );
+  printf( "  -f ppm|png|qoi      -- output image format.\n" );
+  printf( "  -g integer,integer  -- columns and rows of Julia Sets in a sweep.\n" );
+  printf( "  -h                  -- prints this help and exits.\n" );
+  printf( "  -j p,q              -- generate a Julia Set with complex c = p + qi.\n" );
+  printf( "  -J p,q              -- sweep Julia Sets from the -j constant (top left) to\n" );
+  printf( "                         c = p + qi (bottom right).\n" );
+  printf( "  -m integer          -- specifies the maximum # of iterations per pixel\n");
+  printf( "                         before stopping.\n" );
+  printf( "  -o filename         -- save to this output file.\n" );
+  printf( "  -O directory        -- save each Julia Set of a sweep to its own file in\n" );
+  printf( "                         this directory.\n" );
+  printf( "  -p name|file        -- color with the palette classic, gray, fire or ocean,\n" );
+  printf( "                         or a gradient file.\n" );
+  printf( "  -P integer          -- daemon priority of this request.  Higher is sooner.\n" );
+  printf( "  -r integer,integer  -- image resolution.\n" );
+  printf( "  --resume            -- carry on with a render to a .ppm file (or shard)\n" );
+  printf( "                         that was stopped, from the checkpoint file it left\n" );
+  printf( "                         behind.\n" );
+  printf( "  --shard i/N         -- render only shard i (0 to N-1) of the image into\n" );
+  printf( "                         the file given with -o.\n" );
+  printf( "  --merge             -- assemble the shard files listed after the options\n" );
+  printf( "                         into the output image.\n" );
+  printf( "  --save-orbits       -- save where the pixels that reached the maximum # of\n" );
+  printf( "                         iterations got to, in a \".orbits\" file next to\n" );
+  printf( "                         the image, for --continue-to.\n" );
+  printf( "  --selftest          -- render the reference scenes with --deterministic\n" );
+  printf( "                         and check them against their known hashes.\n" );
+  printf( "  -s full|coarse|skip -- in a Julia Set sweep, render the mostly empty sets\n" );
+  printf( "                         with c outside the Mandelbrot Set in full, coarsely\n" );
+  printf( "                         or not at all.\n" );
+  printf( "  -t integer          -- number of worker threads.\n" );
+  printf( "  -T integer          -- render a slippy map tile pyramid from level 0 down\n" );
+  printf( "                         to this level into the directory (or .tar file)\n" );
+  printf( "                         given with -o.  Every pixel is iterated, so the\n" );
+  printf( "                         tiles match a full render, unless --border-fill.\n" );
+  printf( "  -v                  -- print version and exit.\n" );
+  printf( "  -z real             -- set zoom level to real.\n\n" );
+
+  printf( " modes:\n" );
+  printf( "   fractals has 2 modes.  The Mandelbrot mode is the default, but it will\n" );
+  printf( "   switch to Julia Set mode if a \"-j p,q\" option is used.  Adding \"-J p,q\"\n" );
+  printf( "   sweeps a grid of Julia Sets instead.\n\n" );
+
+  printf( " defaults:\n" );
+  printf( "   -- The default center is (0.75,0.0) for Mandelbrot mode and (0.0,0.0) for\n" );
+  printf( "      Julia Set mode.\n" );
+  printf( "   -- The default for m is 2048, or %d with --adaptive.\n", ADAPTIVEMAXCAP );
+  printf( "   -- The default output is to stdout.\n" );
+  printf( "   -- The default output format is taken from the output file name's\n" );
+  printf( "      extension, or is ppm.\n" );
+  printf( "   -- The default image resolution is 1024x768.\n" );
+  printf( "   -- The default zoom level is 1.0 which is a real x-width of 3.1.\n" );
+  printf( "   -- The default number of threads is the number of CPUs.\n" );
+  printf( "   -- The default palette is classic.\n" );
+  printf( "   -- The default Julia Set sweep resolution is %dx%d per Julia Set.\n", SWEEPTHUMBX, SWEEPTHUMBY );
+  printf( "   -- The default Julia Set sweep policy is full.\n\n" );
+
+  printf( " examples:\n" );
+  printf( "   fractals > mset.ppm\n" );
+  printf( "     -- produces a Mandelbrot Set called \"mset.ppm\".\n" );
+  printf( "   fractals -o mset.ppm\n" );
+  printf( "     -- same result as \"fractals > mset.ppm\".\n" );
+  printf( "   fractals -o mset.png\n" );
+  printf( "     -- create a loss-less compressed .png file \"mset.png\".\n" );
+  printf( "   fractals | pnmtojpeg > mset.jpg\n" );
+  printf( "     -- create a lossy compressed jpeg file \"mset.jpg\".  Need \"netpbm\"\n" );
+  printf( "        installed.\n" );
+  printf( "   fractals -j -.194,.6557 > jset.ppm\n" );
+  printf( "     -- create the Julia Set with c = -.194 + .6557i and save in \"jset.ppm\".\n" );
+  printf( "   fractals -j-.194,.6557 -c-.32,0.27 -r1280x960 -m3000 -z4.75 > jset2.ppm\n" );
+  printf( "     -- create the Julia Set with c = -.194 + .6557i and save in \"jset2.ppm\".\n" );
+  printf( "        set center to (-0.32,0.27), resolution to 1280 by 960 pixels, max\n" );
+  printf( "        iterations to 3000 and zoom level to 4.75.\n" );
+  printf( "   fractals -j -1,1 -J 0.5,-1 -g 16,12 -z 0.9 > sweep.ppm\n" );
+  printf( "     -- a contact sheet of 16 by 12 Julia Sets with c from -1 + i to 0.5 - i.\n" );
+  printf( "   fractals -T 6 -m 5000 -o tiles\n" );
+  printf( "     -- write the 256x256 tiles of zoom levels 0 to 6 as tiles/z/x/y.ppm.\n" );
+  printf( "   fractals -d /tmp/fractals.sock &\n" );
+  printf( "   fractals -D /tmp/fractals.sock -z 20 -c -.75,.1 -P 1 > mset2.ppm\n" );
+  printf( "     -- start a daemon, then have it render a zoomed in view.  The request\n" );
+  printf( "        line is just the options, so \"echo -z 20 | nc -U /tmp/fractals.sock\"\n" );
+  printf( "        works too.\n" );
+  printf( "   fractals -r 65536,49152 -m 1000000 -z 900 -c -.7453,.1127 -o big.ppm\n" );
+  printf( "   fractals -r 65536,49152 -m 1000000 -z 900 -c -.7453,.1127 -o big.ppm --resume\n" );
+  printf( "     -- a very long render keeps a checkpoint in \"big.ppm.ckpt\".  If it is\n" );
+  printf( "        stopped, running it again with --resume skips the finished tiles.\n" );
+  printf( "   fractals -r 16384,12288 -m 50000 --shard 0/2 -o part0\n" );
+  printf( "   fractals -r 16384,12288 -m 50000 --shard 1/2 -o part1\n" );
+  printf( "   fractals --merge -o mset.png part0 part1\n" );
+  printf( "     -- split a render in two, to run on two machines, then put it together.\n" );
+  printf( "   fractals -z 40 -c -.7453,.1127 -m 5000 --save-orbits -o mset.ppm\n" );
+  printf( "   fractals --continue-to 50000 -o mset.ppm\n" );
+  printf( "     -- too much black at 5000 iterations, so take the same image to 50000\n" );
+  printf( "        without redoing the first 5000.\n\n" );
+
+  printf( "\n\n" );
+}
+
+// parse out two doubles from inputstr
+int Get2Tuple( char* inputstr, double* first, double* second ) {
+
+  char* tempstr = strdup( inputstr );
+
+  int i;
+  int len = strlen( tempstr );
+
+  char* begdouble1 = NULL;
+  char* begdouble2 = NULL;
+
+  int findbegin = 1;
+  int findnumberparts = 0;
+  for ( i = 0; i < len; i++ ) {
+    int isnumberpart = isdigit( tempstr[i] ) ||  tempstr[i] == '-' || tempstr[i] == '.';
+    if ( findbegin && isnumberpart ) {
+      if ( begdouble1 == NULL )
+        begdouble1 = tempstr + i;
+      else
+        begdouble2 = tempstr + i;
+      findbegin = 0;
+      findnumberparts = 1;
+    }
+    else if ( findnumberparts && !isnumberpart ) {
+      findnumberparts = 0;
+      tempstr[i] = '\0';
+      if ( begdouble2 == NULL )
+        findbegin = 1;
+    }
+  }
+
+  int fail = 1;
+  if ( begdouble1 != NULL && begdouble2 != NULL ) {
+    *first  = atof( begdouble1 );
+    *second = atof( begdouble2 );
+    fail = 0;
+  }
+
+  free( tempstr );
+  tempstr = NULL;
+
+  return fail;
+}
+
+// parse out two longs from inputstr
+int Get2Tuple( char* inputstr, long* first, long* second ) {
+
+  char* tempstr = strdup( inputstr );
+
+  int i;
+  int len = strlen( tempstr );
+
+  char* beglong1 = NULL;
+  char* beglong2 = NULL;
+
+  int findbegin = 1;
+  int findnumberparts = 0;
+  for ( i = 0; i < len; i++ ) {
+    int isnumberpart = isdigit( tempstr[i] );
+    if ( findbegin && isnumberpart ) {
+      if ( beglong1 == NULL )
+        beglong1 = tempstr + i;
+      else
+        beglong2 = tempstr + i;
+      findbegin = 0;
+      findnumberparts = 1;
+    }
+    else if ( findnumberparts && !isnumberpart ) {
+      findnumberparts = 0;
+      tempstr[i] = '\0';
+      if ( beglong2 == NULL )
+        findbegin = 1;
+    }
+  }
+
+  int fail = 1;
+  if ( beglong1 != NULL && beglong2 != NULL ) {
+    *first  = atol( beglong1 );
+    *second = atol( beglong2 );
+    fail = 0;
+  }
+
+  free( tempstr );
+  tempstr = NULL;
+
+  return fail;
+}
+
+// create a palette
+void initpal( struct pixel holdpal[256] ) {
+  int         i;
+
+  for (i = 0; i < 64; i++) {
+    holdpal[i].red = 125 - i;
+    holdpal[i].green = 61 + i;
+    holdpal[i].blue = 254 - (i * 2);
+  }
+
+  for (i = 64; i < 128; i++) {
+    holdpal[i].red = 61 + (i - 64);
+    holdpal[i].green = 125 + ((i - 64) * 2);
+    holdpal[i].blue = 125 - (i - 64);
+  }
+
+  for (i = 128; i < 192; i++) {
+    holdpal[i].red = 125 + ((i - 128) * 2);
+    holdpal[i].green = 254 - ((i - 128) * 2);
+    holdpal[i].blue = 61 + (i - 128);
+  }
+
+  for (i = 192; i < 255; i++) {
+    holdpal[i].red = 254 - ((i - 192) * 2);
+    holdpal[i].green = 125 - (i - 192);
+    holdpal[i].blue = 125 + ((i - 192) * 2);
+  }
+
+  holdpal[255].red = 0;
+  holdpal[255].green = 0;
+  holdpal[255].blue = 0;
+}
+
+/* Palettes.                                                             */
+/*                                                                       */
+/* A palette is a cycle of colors for the points that escape, repeated   */
+/* every "period" iterations, and one color for the points inside the    */
+/* set.  The classic palette is initpal()'s.  The others, built in or    */
+/* read from a file given with -p, are gradients in this form:           */
+/*                                                                       */
+/*   # comment                                                           */
+/*   period 256          (iterations per trip around the stops)          */
+/*   inside 0 0 0        (red green blue of the points in the set)       */
+/*   stop 0 7 100        (two or more stops, evenly spaced, with the     */
+/*   stop 255 170 0       last one blending back into the first)         */
+/*                                                                       */
+/* For a render, the palette is laid out into a color map with an entry  */
+/* for every k from 0 to capk, so coloring a pixel is a single lookup    */
+/* with no modulo and no test for the inside.  (Past MAXCOLORMAP, the    */
+/* map only holds one cycle, and coloring goes back to a modulo.)  With  */
+/* --equalize, the colors of the escaped points are spread over one trip */
+/* around the palette by rank instead: the map is made from a histogram  */
+/* of k, so each color covers about the same number of pixels.           */
+
+#define MAXPALETTEPERIOD   65536
+#define MAXCOLORMAP        ( 1 << 22 )  // most k a color map has an entry for
+
+struct builtinpalette
+{
+  const char*   name;
+  const char*   gradient;
+};
+
+static const struct builtinpalette BuiltinPalettes[] = {
+  { "gray",  "period 128\ninside 0 0 0\nstop 24 24 24\nstop 240 240 240\n" },
+  { "fire",  "period 192\ninside 0 0 0\nstop 20 0 0\nstop 180 20 0\nstop 255 140 0\nstop 255 250 180\n" },
+  { "ocean", "period 256\ninside 0 0 0\nstop 0 7 100\nstop 32 107 203\nstop 237 255 255\nstop 255 170 0\nstop 0 2 0\n" },
+};
+
+// Fill in a palette from the text of a gradient.
+static int ParseGradient( const char* text, struct palette* pal ) {
+
+  struct pixel stops[256];
+  int stopcount = 0;
+  int period = 256;
+  int inside[3] = { 0, 0, 0 };
+
+  const char* line = text;
+  while ( line != NULL && *line != '\0' ) {
+    int r, g, b;
+    while ( *line == ' ' || *line == '\t' )
+      line++;
+    if ( sscanf( line, "stop %d %d %d", &r, &g, &b ) == 3 ) {
+      if ( stopcount == 256 )
+        return -1;
+      stops[stopcount].red   = r < 0 ? 0 : r > 255 ? 255 : r;
+      stops[stopcount].green = g < 0 ? 0 : g > 255 ? 255 : g;
+      stops[stopcount].blue  = b < 0 ? 0 : b > 255 ? 255 : b;
+      stopcount++;
+    }
+    else if ( sscanf( line, "inside %d %d %d", &inside[0], &inside[1], &inside[2] ) == 3 )
+      ;
+    else if ( sscanf( line, "period %d", &period ) == 1 )
+      ;
+    else if ( *line != '#' && *line != '\r' && *line != '\n' )
+      return -1;
+    line = strchr( line, '\n' );
+    if ( line != NULL )
+      line++;
+  }
+  if ( stopcount < 2 || period < 2 || period > MAXPALETTEPERIOD )
+    return -1;
+
+  pal->cycle = (struct pixel*) malloc( sizeof(struct pixel) * period );
+  if ( pal->cycle == NULL )
+    return -1;
+  pal->period = period;
+  pal->inside.red   = inside[0] < 0 ? 0 : inside[0] > 255 ? 255 : inside[0];
+  pal->inside.green = inside[1] < 0 ? 0 : inside[1] > 255 ? 255 : inside[1];
+  pal->inside.blue  = inside[2] < 0 ? 0 : inside[2] > 255 ? 255 : inside[2];
+
+  // blend linearly from each stop to the next, around the cycle
+  int i;
+  for ( i = 0; i < period; i++ ) {
+    long along = (long) i * stopcount;
+    const struct pixel* from = &stops[along / period];
+    const struct pixel* to = &stops[( along / period + 1 ) % stopcount];
+    long t = along % period;
+    pal->cycle[i].red   = ( from->red   * ( period - t ) + to->red   * t ) / period;
+    pal->cycle[i].green = ( from->green * ( period - t ) + to->green * t ) / period;
+    pal->cycle[i].blue  = ( from->blue  * ( period - t ) + to->blue  * t ) / period;
+  }
+  return 0;
+}
+
+// Load the palette called name: NULL or "classic", one of the built in gradients, or
+// (if allowfiles) a gradient file.
+int LoadPalette( const char* name, int allowfiles, struct palette* pal ) {
+
+  memset( pal, 0, sizeof(struct palette) );
+  if ( name == NULL || strcmp( name, "classic" ) == 0 ) {
+    struct pixel holdpal[256];
+    initpal( holdpal );
+    pal->cycle = (struct pixel*) malloc( sizeof(struct pixel) * 254 );
+    if ( pal->cycle == NULL )
+      return -1;
+    memcpy( pal->cycle, holdpal, sizeof(struct pixel) * 254 );
+    pal->period = 254;
+    pal->inside = holdpal[255];
+    return 0;
+  }
+
+  unsigned int i;
+  for ( i = 0; i < sizeof(BuiltinPalettes) / sizeof(BuiltinPalettes[0]); i++ )
+    if ( strcmp( name, BuiltinPalettes[i].name ) == 0 )
+      return ParseGradient( BuiltinPalettes[i].gradient, pal );
+
+  FILE* fp = allowfiles ? fopen( name, "rb" ) : NULL;
+  if ( fp == NULL )
+    return -1;
+  char text[16384];
+  size_t len = fread( text, 1, sizeof(text) - 1, fp );
+  int toolong = !feof( fp );
+  fclose( fp );
+  if ( toolong )
+    return -1;
+  text[len] = '\0';
+  return ParseGradient( text, pal );
+}
+
+// Load the palette -p asked for, saying so if there is no such thing.
+int OptionPalette( const struct options* opt, struct palette* pal ) {
+
+  if ( LoadPalette( opt->palettename, 1, pal ) == 0 )
+    return 0;
+  fprintf( stderr, "Error: There is no palette or palette file \"%s\".\n", opt->palettename );
+  return -1;
+}
+
+void FreePalette( struct palette* pal ) {
+
+  free( pal->cycle );
+  pal->cycle = NULL;
+}
+
+// Lay the palette out for iteration counts from 0 to capk.
+int MakeColorMap( const struct palette* pal, int capk, struct colormap* cm ) {
+
+  cm->capk = capk;
+  cm->period = capk < MAXCOLORMAP ? 0 : pal->period;
+  if ( cm->period != 0 ) {
+    cm->lut = (struct pixel*) malloc( sizeof(struct pixel) * ( pal->period + 1 ) );
+    if ( cm->lut == NULL )
+      return -1;
+    memcpy( cm->lut, pal->cycle, sizeof(struct pixel) * pal->period );
+    cm->lut[pal->period] = pal->inside;
+    return 0;
+  }
+
+  cm->lut = (struct pixel*) malloc( sizeof(struct pixel) * ( (long) capk + 1 ) );
+  if ( cm->lut == NULL )
+    return -1;
+
+  int k;
+  int along = 0;
+  for ( k = 0; k < capk; k++ ) {
+    cm->lut[k] = pal->cycle[along];
+    if ( ++along == pal->period )
+      along = 0;
+  }
+  cm->lut[capk] = pal->inside;
+  return 0;
+}
+
+// Lay the palette out by the rank of each k among the escaped pixels, from
+// hist, which counts the pixels with each k from 0 to capk - 1.
+int MakeEqualizedColorMap( const struct palette* pal, int capk, const long long* hist, struct colormap* cm ) {
+
+  cm->capk = capk;
+  cm->period = 0;
+  cm->lut = (struct pixel*) malloc( sizeof(struct pixel) * ( (long) capk + 1 ) );
+  if ( cm->lut == NULL )
+    return -1;
+
+  long long total = 0;
+  int k;
+  for ( k = 0; k < capk; k++ )
+    total += hist[k];
+
+  long long below = 0;  // pixels with a lower k
+  for ( k = 0; k < capk; k++ ) {
+    long along = total > 0 ? (long) ( (double) below * pal->period / total ) : 0;
+    cm->lut[k] = pal->cycle[along < pal->period ? along : pal->period - 1];
+    below += hist[k];
+  }
+  cm->lut[capk] = pal->inside;
+  return 0;
+}
+
+void FreeColorMap( struct colormap* cm ) {
+
+  free( cm->lut );
+  cm->lut = NULL;
+}
+
+int DefaultThreadCount() {
+
+#if defined(HAVE_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+  long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+  if ( cpus > 0 )
+    return (int) cpus;
+#endif
+  return 1;
+}
+
+// Run fn(arg) on the given number of threads (the calling thread included) and wait for them all.
+void RunWorkers( int threads, void* (*fn)( void* ), void* arg ) {
+
+#if defined(HAVE_PTHREADS)
+  pthread_t* tids = NULL;
+  int started = 0;
+  if ( threads > 1 )
+    tids = (pthread_t*) malloc( sizeof(pthread_t) * ( threads - 1 ) );
+  if ( tids != NULL )
+    for ( ; started < threads - 1; started++ )
+      if ( pthread_create( &tids[started], NULL, fn, arg ) != 0 )
+        break;
+
+  fn( arg );
+
+  int i;
+  for ( i = 0; i < started; i++ )
+    pthread_join( tids[i], NULL );
+  free( tids );
+#else
+  fn( arg );
+#endif
+}
+
+// Add to a counter shared between threads, returning its old value.
+long AtomicAdd( long* counter, long amount ) {
+
+#if defined(HAVE_PTHREADS)
+  return __sync_fetch_and_add( counter, amount );
+#else
+  long old = *counter;
+  *counter += amount;
+  return old;
+#endif
+}
+
+// Hand out work items 0,1,2,... to whichever thread asks next.
+long NextWorkItem( long* counter ) {
+
+  return AtomicAdd( counter, 1 );
+}
+
+// Seconds on a monotonic clock, for progress reports.
+double WallSeconds() {
+
+#if defined(HAVE_PTHREADS)
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Make a directory, or use the one already there.  errno says why not.
+int MakeDir( const char* path ) {
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+  if ( _mkdir( path ) == 0 )
+    return 0;
+  struct _stat sb;
+  int isdir = errno == EEXIST && _stat( path, &sb ) == 0 && ( sb.st_mode & _S_IFDIR ) != 0;
+#else
+  if ( mkdir( path, 0777 ) == 0 )
+    return 0;
+  struct stat sb;
+  int isdir = errno == EEXIST && stat( path, &sb ) == 0 && S_ISDIR( sb.st_mode );
+#endif
+  if ( isdir )
+    return 0;
+  if ( errno == EEXIST )
+    errno = ENOTDIR;  // something else has the name
+  return -1;
+}
+
+#if defined(HAVE_PTHREADS)
+
+/* Daemon mode.                                                          */
+/*                                                                       */
+/* The daemon listens on a unix domain socket.  A client connects and    */
+/* sends one line holding the same options as the command line (only     */
+/* -c -j -m -r -z, the priority -P, and -f or the -o name for the image  */
+/* format are used), then reads back the image as it is rendered, a row  */
+/* of tiles at a time, encoded the same way as any other output.         */
+/*                                                                       */
+/* Requests are split into TILESIZE x TILESIZE tiles which a shared pool */
+/* of worker threads takes from the highest priority job first.  A       */
+/* request identical to one already in progress is attached to that job  */
+/* rather than rendered again, and finished tiles are kept in a small    */
+/* cache so repeats and overlapping views reuse them.  Tiles are cached  */
+/* by iteration count, not colour.                                       */
+
+#define TILECACHESLOTS   1024
+#define MAXREQUESTLEN    4096
+#define MAXREQUESTARGS   64
+#define MAXDAEMONPIXELS  (1L << 28)
+
+struct tilekey
+{
+  int       MakeJuliaSet;
+  double    c_r;
+  double    c_i;
+  int       capk;
+  double    pixelwidth;
+  double    x0;         // centre of the tile's top left pixel
+  double    y0;
+  long      w;
+  long      h;
+};
+
+struct cachedtile
+{
+  struct tilekey    key;
+  int*              k;          // NULL while the slot is unused
+  unsigned long     lastused;
+};
+
+struct renderjob
+{
+  struct view         v;
+  int                 priority;
+  unsigned long       seq;         // arrival order, to break priority ties
+  long                tilesx;
+  long                tilesy;
+  long                nexttile;    // next tile to hand to a worker
+  long*               tilesdone;   // finished tiles in each row of tiles
+  int*                kbuf;        // resolx * resoly iteration counts
+  int                 clients;     // attached clients
+  int                 cancelled;   // set when the last client goes away early
+  int                 refcount;    // attached clients plus busy workers
+  struct renderjob*   next;
+};
+
+struct daemonstate
+{
+  pthread_mutex_t     lock;
+  pthread_cond_t      workready;   // signalled when a job has tiles to hand out
+  pthread_cond_t      tiledone;    // broadcast when a tile is finished
+  struct renderjob*   jobs;
+  unsigned long       jobseq;
+  struct cachedtile   cache[TILECACHESLOTS];
+  unsigned long       cacheclock;
+};
+
+struct clientarg
+{
+  struct daemonstate* ds;
+  int                 fd;
+};
+
+static int SameView( const struct view* v1, const struct view* v2 ) {
+
+  return v1->MakeJuliaSet == v2->MakeJuliaSet && v1->c_r == v2->c_r && v1->c_i == v2->c_i &&
+         v1->centerx == v2->centerx && v1->centery == v2->centery && v1->zoomlevel == v2->zoomlevel &&
+         v1->resolx == v2->resolx && v1->resoly == v2->resoly && v1->capk == v2->capk;
+}
+
+static void MakeTileKey( const struct view* v, long x0, long y0, long w, long h, struct tilekey* key ) {
+
+  memset( key, 0, sizeof(struct tilekey) );
+  key->MakeJuliaSet = v->MakeJuliaSet;
+  key->c_r          = v->c_r;
+  key->c_i          = v->c_i;
+  key->capk         = v->capk;
+  key->pixelwidth   = v->pixelwidth;
+  key->x0           = v->xminplushalf + x0 * v->pixelwidth;
+  key->y0           = v->ymaxlesshalf - y0 * v->pixelwidth;
+  key->w            = w;
+  key->h            = h;
+}
+
+static int SameTileKey( const struct tilekey* k1, const struct tilekey* k2 ) {
+
+  return k1->MakeJuliaSet == k2->MakeJuliaSet && k1->c_r == k2->c_r && k1->c_i == k2->c_i &&
+         k1->capk == k2->capk && k1->pixelwidth == k2->pixelwidth &&
+         k1->x0 == k2->x0 && k1->y0 == k2->y0 && k1->w == k2->w && k1->h == k2->h;
+}
+
+// Look up a tile in the cache and copy it to dest.  Call with ds->lock held.
+static int CacheLookup( struct daemonstate* ds, const struct tilekey* key, int* dest ) {
+
+  int i;
+  for ( i = 0; i < TILECACHESLOTS; i++ ) {
+    struct cachedtile* slot = &ds->cache[i];
+    if ( slot->k != NULL && SameTileKey( &slot->key, key ) ) {
+      slot->lastused = ++ds->cacheclock;
+      memcpy( dest, slot->k, sizeof(int) * key->w * key->h );
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Store a tile, replacing the least recently used one.  Call with ds->lock held.
+static void CacheInsert( struct daemonstate* ds, const struct tilekey* key, const int* src ) {
+
+  struct cachedtile* victim = &ds->cache[0];
+  int i;
+  for ( i = 0; i < TILECACHESLOTS; i++ ) {
+    struct cachedtile* slot = &ds->cache[i];
+    if ( slot->k == NULL ) {
+      victim = slot;
+      break;
+    }
+    if ( slot->lastused < victim->lastused )
+      victim = slot;
+  }
+
+  free( victim->k );
+  victim->k = (int*) malloc( sizeof(int) * key->w * key->h );
+  if ( victim->k == NULL )
+    return;
+  memcpy( victim->k, src, sizeof(int) * key->w * key->h );
+  victim->key = *key;
+  victim->lastused = ++ds->cacheclock;
+}
+
+// Drop a reference to a job, freeing it with the last one.  Call with ds->lock held.
+static void ReleaseJob( struct daemonstate* ds, struct renderjob* job ) {
+
+  job->refcount--;
+  if ( job->refcount > 0 )
+    return;
+
+  struct renderjob** link = &ds->jobs;
+  while ( *link != job )
+    link = &(*link)->next;
+  *link = job->next;
+
+  free( job->tilesdone );
+  free( job->kbuf );
+  free( job );
+}
+
+// The highest priority job with tiles left to hand out.  Call with ds->lock held.
+static struct renderjob* PickJob( struct daemonstate* ds ) {
+
+  struct renderjob* best = NULL;
+  struct renderjob* job;
+  for ( job = ds->jobs; job != NULL; job = job->next ) {
+    if ( job->cancelled || job->nexttile >= job->tilesx * job->tilesy )
+      continue;
+    if ( best == NULL || job->priority > best->priority ||
+         ( job->priority == best->priority && job->seq < best->seq ) )
+      best = job;
+  }
+  return best;
+}
+
+static void* DaemonWorker( void* arg ) {
+
+  struct daemonstate* ds = (struct daemonstate*) arg;
+  int* tilek = (int*) malloc( sizeof(int) * TILESIZE * TILESIZE );
+  if ( tilek == NULL )
+    return NULL;
+
+  pthread_mutex_lock( &ds->lock );
+  for (;;) {
+    struct renderjob* job = PickJob( ds );
+    if ( job == NULL ) {
+      pthread_cond_wait( &ds->workready, &ds->lock );
+      continue;
+    }
+
+    long tile = job->nexttile++;
+    job->refcount++;
+
+    const struct view* v = &job->v;
+    long tx = tile % job->tilesx;
+    long ty = tile / job->tilesx;
+    long x0 = tx * TILESIZE;
+    long y0 = ty * TILESIZE;
+    long w  = v->resolx - x0 < TILESIZE ? v->resolx - x0 : TILESIZE;
+    long h  = v->resoly - y0 < TILESIZE ? v->resoly - y0 : TILESIZE;
+
+    struct tilekey key;
+    MakeTileKey( v, x0, y0, w, h, &key );
+    int cached = CacheLookup( ds, &key, tilek );
+
+    pthread_mutex_unlock( &ds->lock );
+
+    if ( !cached )
+      RenderTile( v, x0, y0, w, h, tilek );
+
+    long y;
+    for ( y = 0; y < h; y++ )
+      memcpy( &job->kbuf[(y0 + y) * v->resolx + x0], &tilek[y * w], sizeof(int) * w );
+
+    pthread_mutex_lock( &ds->lock );
+    if ( !cached )
+      CacheInsert( ds, &key, tilek );
+    job->tilesdone[ty]++;
+    pthread_cond_broadcast( &ds->tiledone );
+    ReleaseJob( ds, job );
+  }
+
+  return NULL;
+}
+
+static int SendAll( int fd, const void* buf, size_t len ) {
+
+  const char* p = (const char*) buf;
+  while ( len > 0 ) {
+    ssize_t sent = send( fd, p, len, MSG_NOSIGNAL );
+    if ( sent < 0 && errno == EINTR )
+      continue;
+    if ( sent <= 0 )
+      return -1;
+    p += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+static void SendError( int fd, const char* msg ) {
+
+  SendAll( fd, msg, strlen( msg ) );
+}
+
+// Serve one client connection: read its request, attach it to a job and stream the image back.
+static void* DaemonClient( void* arg ) {
+
+  struct clientarg* ca = (struct clientarg*) arg;
+  struct daemonstate* ds = ca->ds;
+  int fd = ca->fd;
+  free( ca );
+
+  char request[MAXREQUESTLEN];
+  long len = 0;
+  while ( len < MAXREQUESTLEN - 1 ) {
+    ssize_t got = recv( fd, request + len, MAXREQUESTLEN - 1 - len, 0 );
+    if ( got < 0 && errno == EINTR )
+      continue;
+    if ( got <= 0 )
+      break;
+    len += got;
+    if ( memchr( request + len - got, '\n', got ) != NULL )
+      break;
+  }
+  request[len] = '\0';
+
+  // split the request line into an argv[] for ParseOptions()
+  char* reqargv[MAXREQUESTARGS];
+  int reqargc = 0;
+  reqargv[reqargc++] = (char*) "fractals";
+  char* token = strtok( request, " \t\r\n" );
+  while ( token != NULL && reqargc < MAXREQUESTARGS ) {
+    reqargv[reqargc++] = token;
+    token = strtok( NULL, " \t\r\n" );
+  }
+
+  // palette files are the client's, so only the built in palettes are offered
+  struct options opt;
+  ParseOptions( reqargc, reqargv, &opt );
+  struct palette pal;
+  int nopalette = LoadPalette( opt.palettename, 0, &pal );
+  int format = ImageFormat( opt.formatname, opt.userfilename );
+  FreeOptions( &opt );
+
+  struct view v;
+  SetupView( &opt, &v );
+  if ( v.resolx < 1 || v.resoly < 1 || v.resolx > MAXDAEMONPIXELS / v.resoly ) {
+    SendError( fd, "Error: Bad image resolution.\n" );
+    if ( nopalette == 0 )
+      FreePalette( &pal );
+    close( fd );
+    return NULL;
+  }
+  if ( nopalette != 0 ) {
+    SendError( fd, "Error: The daemon only has the built in palettes.\n" );
+    close( fd );
+    return NULL;
+  }
+  struct colormap cm;
+  int nomap = MakeColorMap( &pal, v.capk, &cm );
+  FreePalette( &pal );
+  if ( nomap != 0 ) {
+    SendError( fd, "Error: Not enough memory.\n" );
+    close( fd );
+    return NULL;
+  }
+
+  // attach to an identical job if there is one, otherwise queue a new job
+  pthread_mutex_lock( &ds->lock );
+  struct renderjob* job;
+  for ( job = ds->jobs; job != NULL; job = job->next )
+    if ( !job->cancelled && SameView( &job->v, &v ) )
+      break;
+
+  if ( job != NULL ) {
+    job->clients++;
+    job->refcount++;
+    if ( opt.user_priority > job->priority )
+      job->priority = opt.user_priority;
+  }
+  else {
+    job = (struct renderjob*) calloc( 1, sizeof(struct renderjob) );
+    if ( job != NULL ) {
+      job->v        = v;
+      job->priority = opt.user_priority;
+      job->seq      = ++ds->jobseq;
+      job->tilesx   = ( v.resolx + TILESIZE - 1 ) / TILESIZE;
+      job->tilesy   = ( v.resoly + TILESIZE - 1 ) / TILESIZE;
+      job->tilesdone = (long*) calloc( job->tilesy, sizeof(long) );
+      job->kbuf     = (int*) malloc( sizeof(int) * v.resolx * v.resoly );
+      job->clients  = 1;
+      job->refcount = 1;
+      if ( job->tilesdone == NULL || job->kbuf == NULL ) {
+        free( job->tilesdone );
+        free( job->kbuf );
+        free( job );
+        job = NULL;
+      }
+      else {
+        job->next = ds->jobs;
+        ds->jobs = job;
+        pthread_cond_broadcast( &ds->workready );
+      }
+    }
+  }
+  pthread_mutex_unlock( &ds->lock );
+
+  if ( job == NULL ) {
+    SendError( fd, "Error: Not enough memory.\n" );
+    FreeColorMap( &cm );
+    close( fd );
+    return NULL;
+  }
+
+  // stream back each row of tiles as soon as it is complete, in the client's format
+  struct pixel* rowpixels = (struct pixel*) malloc( sizeof(struct pixel) * v.resolx * ( TILESIZE + 1 ) );
+  int ok = rowpixels != NULL;
+
+  struct imageencoder ie;
+  struct membuf mb = { NULL, 0, 0, 0 };
+  StartImage( &ie, &mb, format, v.resolx, v.resoly );
+
+  long ty;
+  for ( ty = 0; ok && ty < job->tilesy; ty++ ) {
+    pthread_mutex_lock( &ds->lock );
+    while ( job->tilesdone[ty] < job->tilesx )
+      pthread_cond_wait( &ds->tiledone, &ds->lock );
+    pthread_mutex_unlock( &ds->lock );
+
+    // rowpixels[0] keeps the last row of the tile row before, for the PNG filters
+    long y0 = ty * TILESIZE;
+    long rows = v.resoly - y0 < TILESIZE ? v.resoly - y0 : TILESIZE;
+    ColorPixels( &job->kbuf[y0 * v.resolx], v.resolx * rows, &cm, rowpixels + v.resolx );
+    EncodeRows( &ie, &mb, rowpixels + v.resolx, ty > 0 ? rowpixels : NULL, rows );
+    memcpy( rowpixels, rowpixels + v.resolx * rows, sizeof(struct pixel) * v.resolx );
+    if ( ty == job->tilesy - 1 )
+      FinishImage( &ie, &mb );
+    ok = !mb.failed && SendAll( fd, mb.data, mb.len ) == 0;
+    mb.len = 0;
+  }
+
+  free( mb.data );
+  free( rowpixels );
+  FreeColorMap( &cm );
+  close( fd );
+
+  pthread_mutex_lock( &ds->lock );
+  job->clients--;
+  if ( !ok && job->clients == 0 )
+    job->cancelled = 1;  // nobody else wants the rest of it
+  ReleaseJob( ds, job );
+  pthread_mutex_unlock( &ds->lock );
+
+  return NULL;
+}
+
+int RunDaemon( const char* socketpath, int threads ) {
+
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+  if ( strlen( socketpath ) >= sizeof(addr.sun_path) ) {
+    printf( "Error: Socket path \"%s\" is too long.  Exiting.\n\n", socketpath );
+    return -1;
+  }
+  strcpy( addr.sun_path, socketpath );
+
+  int listenfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( listenfd < 0 ) {
+    printf( "Error: Could not create a socket.  Exiting.\n\n" );
+    return -1;
+  }
+
+  // a socket left behind by a daemon that is no longer running may be replaced
+  struct stat sb;
+  if ( stat( socketpath, &sb ) == 0 ) {
+    int probefd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    int inuse = !S_ISSOCK( sb.st_mode ) || connect( probefd, (struct sockaddr*) &addr, sizeof(addr) ) == 0;
+    close( probefd );
+    if ( inuse ) {
+      printf( "\"%s\" already exists or is in use.  Refusing to overwrite.  Exiting.\n\n", socketpath );
+      close( listenfd );
+      return -1;
+    }
+    unlink( socketpath );
+  }
+
+  if ( bind( listenfd, (struct sockaddr*) &addr, sizeof(addr) ) != 0 || listen( listenfd, 64 ) != 0 ) {
+    printf( "Error: Could not listen on \"%s\".  Exiting.\n\n", socketpath );
+    close( listenfd );
+    return -1;
+  }
+
+  signal( SIGPIPE, SIG_IGN );
+
+  struct daemonstate* ds = (struct daemonstate*) calloc( 1, sizeof(struct daemonstate) );
+  if ( ds == NULL ) {
+    printf( "\nNot enough memory.  Exiting.\n" );
+    close( listenfd );
+    return -1;
+  }
+  pthread_mutex_init( &ds->lock, NULL );
+  pthread_cond_init( &ds->workready, NULL );
+  pthread_cond_init( &ds->tiledone, NULL );
+
+  int i;
+  for ( i = 0; i < threads; i++ ) {
+    pthread_t tid;
+    if ( pthread_create( &tid, NULL, DaemonWorker, ds ) == 0 )
+      pthread_detach( tid );
+  }
+
+  fprintf( stderr, "fractals daemon listening on \"%s\" with %d worker threads.\n", socketpath, threads );
+
+  for (;;) {
+    int fd = accept( listenfd, NULL, NULL );
+    if ( fd < 0 ) {
+      if ( errno == EINTR || errno == ECONNABORTED )
+        continue;
+      break;
+    }
+
+    struct clientarg* ca = (struct clientarg*) malloc( sizeof(struct clientarg) );
+    pthread_t tid;
+    if ( ca == NULL ) {
+      close( fd );
+      continue;
+    }
+    ca->ds = ds;
+    ca->fd = fd;
+    if ( pthread_create( &tid, NULL, DaemonClient, ca ) == 0 )
+      pthread_detach( tid );
+    else {
+      free( ca );
+      close( fd );
+    }
+  }
+
+  close( listenfd );
+  unlink( socketpath );
+  return -1;
+}
+
+// Send our command line to a running daemon and copy the image it returns to fpout.
+int RunClient( const char* socketpath, int argc, char* argv[], FILE* fpout ) {
+
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+  if ( strlen( socketpath ) >= sizeof(addr.sun_path) ) {
+    fprintf( stderr, "Error: Socket path \"%s\" is too long.  Exiting.\n\n", socketpath );
+    return -1;
+  }
+  strcpy( addr.sun_path, socketpath );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 || connect( fd, (struct sockaddr*) &addr, sizeof(addr) ) != 0 ) {
+    fprintf( stderr, "Error: Could not connect to the daemon on \"%s\".  Exiting.\n\n", socketpath );
+    if ( fd >= 0 )
+      close( fd );
+    return -1;
+  }
+
+  char request[MAXREQUESTLEN];
+  request[0] = '\0';
+  long len = 0;
+  int i;
+  for ( i = 1; i < argc; i++ ) {
+    long arglen = strlen( argv[i] );
+    if ( len + arglen + 2 >= MAXREQUESTLEN )
+      break;
+    strcpy( request + len, argv[i] );
+    len += arglen;
+    request[len++] = i + 1 < argc ? ' ' : '\n';
+    request[len] = '\0';
+  }
+  if ( len == 0 || request[len-1] != '\n' ) {
+    request[len++] = '\n';
+    request[len] = '\0';
+  }
+
+  signal( SIGPIPE, SIG_IGN );
+  if ( SendAll( fd, request, len ) != 0 ) {
+    fprintf( stderr, "Error: Could not send the request to the daemon.  Exiting.\n\n" );
+    close( fd );
+    return -1;
+  }
+
+  // the reply is either the image or a line saying what was wrong with the request
+  char buf[65536];
+  long total = 0;
+  int iserror = 0;
+  int failed = 0;
+  for (;;) {
+    ssize_t got = recv( fd, buf + ( iserror ? total : 0 ), sizeof(buf) - 1 - ( iserror ? total : 0 ), 0 );
+    if ( got < 0 && errno == EINTR )
+      continue;
+    if ( got <= 0 )
+      break;
+    if ( total == 0 && got >= 6 && memcmp( buf, "Error:", 6 ) == 0 )
+      iserror = 1;
+    total += got;
+    if ( iserror ) {
+      if ( total >= (long) sizeof(buf) - 1 )
+        break;
+    }
+    else if ( !failed && fwrite( buf, 1, got, fpout ) != (size_t) got )
+      failed = 1;
+  }
+  close( fd );
+
+  if ( iserror ) {
+    buf[total] = '\0';
+    fprintf( stderr, "%s", buf );
+    return -1;
+  }
+  if ( total == 0 ) {
+    fprintf( stderr, "Error: The daemon on \"%s\" sent no image.\n", socketpath );
+    return -1;
+  }
+  if ( failed || fflush( fpout ) != 0 ) {
+    fprintf( stderr, "Error: Could not write the image.\n" );
+    return -1;
+  }
+  return 0;
+}
+
+#else
+
+int RunDaemon( const char* socketpath, int threads ) {
+
+  printf( "Error: Daemon mode is not available on this platform.  Exiting.\n\n" );
+  return -1;
+}
+
+int RunClient( const char* socketpath, int argc, char* argv[], FILE* fpout ) {
+
+  fprintf( stderr, "Error: Daemon mode is not available on this platform.  Exiting.\n\n" );
+  return -1;
+}
+
+#endif
+
+/* Tile pyramid mode.                                                    */
+/*                                                                       */
+/* Renders every z/x/y tile of a slippy map from level 0 down to the     */
+/* requested level.  Level 0 is a single square tile whose width is the  */
+/* usual x-width for the zoom level (-z) around the centre (-c), and     */
+/* each level below splits every tile into four.  Tiles go to            */
+/* dir/z/x/y.ppm (or .png or .qoi with -f), or into a single tar archive */
+/* if the output name ends in ".tar".                                    */
+/*                                                                       */
+/* Every pixel of every tile is iterated unless --border-fill is given.  */
+/* Then a quadrant of a tile that came out entirely inside the set makes */
+/* the child tile covering it a candidate for filling: only the child's  */
+/* border pixels are iterated, and if all of them stay bounded the whole */
+/* tile is filled without iterating its inside.  This is a heuristic,    */
+/* not a proof.  The points that stay within the escape radius for n     */
+/* iterations form a set with no holes, so a closed border inside it     */
+/* would do, but the border is only sampled at pixel centres and a thin  */
+/* escaping filament can pass between two of them.  Requiring the        */
+/* parent's quadrant to have been all inside as well makes that rare.    */
+
+#define PYRAMIDTILESIZE   256
+#define MAXPYRAMIDLEVEL   16
+
+#define QUADINTERIOR(q)   ( 1 << (q) )       // every pixel in quadrant q hit capk
+#define QUADEXTERIOR(q)   ( 1 << ( 4 + (q) ) )  // every pixel in quadrant q escaped
+
+struct pyramidstate
+{
+  struct view           v;          // the whole current level as one big image
+  int                   level;
+  long                  tilesperside;
+  const unsigned char*  parentclass;  // one byte per tile of the level above
+  unsigned char*        tileclass;    // one byte per tile of this level
+  long                  nexttile;
+  const char*           outdir;
+  FILE*                 tarfile;
+  int                   format;
+  int                   borderfill;   // --border-fill
+  struct colormap       cm;
+  int                   failed;
+
+  long                  tilesdone;
+  long                  tilesfilled;
+  long                  pixelsiterated;
+  long                  totaltiles;
+  double                starttime;
+  double                lastreport;
+
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_t       lock;
+#endif
+};
+
+static void PyramidLock( struct pyramidstate* ps ) {
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_lock( &ps->lock );
+#endif
+}
+
+static void PyramidUnlock( struct pyramidstate* ps ) {
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_unlock( &ps->lock );
+#endif
+}
+
+// Append one file to a tar archive.  Call with the lock held.
+static int TarAppend( FILE* tarfile, const char* name, const unsigned char* data, long size ) {
+
+  unsigned char header[512];
+  memset( header, 0, sizeof(header) );
+  long namelen = strlen( name );
+  memcpy( header, name, namelen < 100 ? namelen : 99 );
+  sprintf( (char*) header + 100, "%07o", 0644 );
+  sprintf( (char*) header + 108, "%07o", 0 );
+  sprintf( (char*) header + 116, "%07o", 0 );
+  sprintf( (char*) header + 124, "%011lo", (unsigned long) size );
+  sprintf( (char*) header + 136, "%011lo", 0UL );
+  header[156] = '0';
+  memcpy( header + 257, "ustar", 6 );
+  memcpy( header + 263, "00", 2 );
+
+  memset( header + 148, ' ', 8 );
+  unsigned long checksum = 0;
+  int i;
+  for ( i = 0; i < 512; i++ )
+    checksum += header[i];
+  sprintf( (char*) header + 148, "%06lo", checksum );
+  header[155] = ' ';
+
+  static const unsigned char zeroes[512] = { 0 };
+  if ( fwrite( header, 1, 512, tarfile ) != 512 )
+    return -1;
+  if ( fwrite( data, 1, size, tarfile ) != (size_t) size )
+    return -1;
+  if ( size % 512 != 0 && fwrite( zeroes, 1, 512 - size % 512, tarfile ) != (size_t)( 512 - size % 512 ) )
+    return -1;
+  return 0;
+}
+
+static void* PyramidWorker( void* arg ) {
+
+  struct pyramidstate* ps = (struct pyramidstate*) arg;
+  const long T = PYRAMIDTILESIZE;
+  const struct view* v = &ps->v;
+  int capk = v->capk;
+
+  int* kbuf = (int*) malloc( sizeof(int) * T * T );
+  struct pixel* pixels = (struct pixel*) malloc( sizeof(struct pixel) * T * T );
+  if ( kbuf == NULL || pixels == NULL ) {
+    ps->failed = 1;
+    free( pixels );
+    free( kbuf );
+    return NULL;
+  }
+
+  long tile;
+  while ( !ps->failed && ( tile = NextWorkItem( &ps->nexttile ) ) < ps->tilesperside * ps->tilesperside ) {
+    long tx = tile % ps->tilesperside;
+    long ty = tile / ps->tilesperside;
+    long x0 = tx * T;
+    long y0 = ty * T;
+    long iterated = 0;
+    int filled = 0;
+
+    // was the part of the parent tile we cover all inside the set?
+    int candidate = 0;
+    if ( ps->borderfill && ps->parentclass != NULL ) {
+      long parentside = ps->tilesperside / 2;
+      int quadrant = ( tx & 1 ) + 2 * ( ty & 1 );
+      candidate = ( ps->parentclass[(ty / 2) * parentside + tx / 2] & QUADINTERIOR( quadrant ) ) != 0;
+    }
+
+    if ( candidate ) {
+      int bounded = 1;
+      long i;
+      for ( i = 0; i < T; i++ ) {
+        kbuf[i]               = IteratePixel( v, x0 + i, y0 );
+        kbuf[(T - 1) * T + i] = IteratePixel( v, x0 + i, y0 + T - 1 );
+        kbuf[i * T]           = IteratePixel( v, x0, y0 + i );
+        kbuf[i * T + T - 1]   = IteratePixel( v, x0 + T - 1, y0 + i );
+        if ( kbuf[i] != capk || kbuf[(T - 1) * T + i] != capk || kbuf[i * T] != capk || kbuf[i * T + T - 1] != capk ) {
+          bounded = 0;
+          i++;
+          break;
+        }
+      }
+      iterated = 4 * i;
+
+      if ( bounded ) {
+        for ( i = 0; i < T * T; i++ )
+          kbuf[i] = capk;
+        filled = 1;
+      }
+    }
+
+    if ( !filled ) {
+      RenderTile( v, x0, y0, T, T, kbuf );
+      iterated = T * T;
+    }
+
+    // classify the quadrants for the next level down
+    unsigned char cls = 0;
+    int q;
+    for ( q = 0; q < 4; q++ ) {
+      long qx0 = ( q & 1 ) * ( T / 2 );
+      long qy0 = ( q >> 1 ) * ( T / 2 );
+      int allinterior = 1;
+      int allexterior = 1;
+      long x, y;
+      for ( y = qy0; y < qy0 + T / 2; y++ )
+        for ( x = qx0; x < qx0 + T / 2; x++ ) {
+          if ( kbuf[y * T + x] == capk )
+            allexterior = 0;
+          else
+            allinterior = 0;
+        }
+      if ( allinterior )
+        cls |= QUADINTERIOR( q );
+      if ( allexterior )
+        cls |= QUADEXTERIOR( q );
+    }
+    ps->tileclass[tile] = cls;
+
+    ColorPixels( kbuf, T * T, &ps->cm, pixels );
+    const char* extension = ImageExtension( ps->format );
+
+    char name[256];
+    int writefailed = 0;
+    if ( ps->tarfile != NULL ) {
+      struct membuf file = { NULL, 0, 0, 0 };
+      writefailed = EncodeImage( &file, ps->format, pixels, T, T ) != 0;
+      sprintf( name, "%d/%ld/%ld.%s", ps->level, tx, ty, extension );
+      PyramidLock( ps );
+      if ( !writefailed )
+        writefailed = TarAppend( ps->tarfile, name, file.data, file.len ) != 0;
+      PyramidUnlock( ps );
+      free( file.data );
+    }
+    else {
+      snprintf( name, sizeof(name), "%s/%d/%ld/%ld.%s", ps->outdir, ps->level, tx, ty, extension );
+      writefailed = WriteImageFile( name, ps->format, pixels, T, T ) != 0;
+    }
+    if ( writefailed ) {
+      fprintf( stderr, "Error: Could not write tile %d/%ld/%ld.\n", ps->level, tx, ty );
+      ps->failed = 1;
+    }
+
+    PyramidLock( ps );
+    ps->tilesdone++;
+    ps->tilesfilled += filled;
+    ps->pixelsiterated += iterated;
+    double now = WallSeconds();
+    if ( now - ps->lastreport >= 1.0 ) {
+      double elapsed = now - ps->starttime;
+      fprintf( stderr, "\rlevel %d: %ld of %ld tiles, %.1f tiles/s, %.2f Mpixels/s, %ld filled   ",
+               ps->level, ps->tilesdone, ps->totaltiles, ps->tilesdone / elapsed,
+               ps->tilesdone * (double)( T * T ) / elapsed / 1e6, ps->tilesfilled );
+      ps->lastreport = now;
+    }
+    PyramidUnlock( ps );
+  }
+
+  free( pixels );
+  free( kbuf );
+  return NULL;
+}
+
+int RunPyramid( const struct options* opt, int maxlevel, int threads ) {
+
+  if ( opt->userfilename == NULL ) {
+    printf( "Error: Tile pyramid mode needs an output directory or .tar file (-o).  Exiting.\n\n" );
+    return -1;
+  }
+  if ( maxlevel > MAXPYRAMIDLEVEL ) {
+    printf( "Error: The deepest pyramid level allowed is %d.  Exiting.\n\n", MAXPYRAMIDLEVEL );
+    return -1;
+  }
+
+  const char* outname = opt->userfilename;
+  long namelen = strlen( outname );
+  int usetar = namelen > 4 && strcmp( outname + namelen - 4, ".tar" ) == 0;
+
+  FILE* fdtest = fopen( outname, "r" );
+  if ( fdtest != NULL ) {
+    printf("Output \"%s\" already exists.  Refusing to overwrite.  Exiting.\n\n", outname );
+    fclose( fdtest );
+    return -1;
+  }
+
+  struct view base;
+  SetupView( opt, &base );
+  struct palette pal;
+  if ( OptionPalette( opt, &pal ) != 0 )
+    return -1;
+
+  struct pyramidstate* ps = (struct pyramidstate*) calloc( 1, sizeof(struct pyramidstate) );
+  if ( ps == NULL || MakeColorMap( &pal, base.capk, &ps->cm ) != 0 ) {
+    printf( "\nNot enough memory.  Exiting.\n" );
+    FreePalette( &pal );
+    free( ps );
+    return -1;
+  }
+  FreePalette( &pal );
+  ps->outdir = outname;
+  ps->format = ImageFormat( opt->formatname, NULL );
+  ps->borderfill = opt->borderfill;
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_init( &ps->lock, NULL );
+#endif
+
+  if ( usetar ) {
+    ps->tarfile = fopen( outname, "wb" );
+    if ( ps->tarfile == NULL ) {
+      printf("Error: Could not open file \"%s\" for write.  Exiting.\n\n", outname );
+      FreeColorMap( &ps->cm );
+      free( ps );
+      return -1;
+    }
+  }
+  else if ( MakeDir( outname ) != 0 ) {
+    printf("Error: Could not create directory \"%s\": %s.  Exiting.\n\n", outname, strerror( errno ) );
+    FreeColorMap( &ps->cm );
+    free( ps );
+    return -1;
+  }
+
+  double fullwidth = 3.1 / base.zoomlevel;
+  double overallstart = WallSeconds();
+  long overalltiles = 0;
+  long overallfilled = 0;
+
+  unsigned char* parentclass = NULL;
+  int level;
+  for ( level = 0; level <= maxlevel && !ps->failed; level++ ) {
+    long tilesperside = 1L << level;
+
+    // the whole level is one image of tilesperside * PYRAMIDTILESIZE pixels square
+    ps->v = base;
+    ps->v.resolx = ps->v.resoly = tilesperside * PYRAMIDTILESIZE;
+    ps->v.pixelwidth = fullwidth / ps->v.resolx;
+    ps->v.xminplushalf = base.centerx - fullwidth / 2.0 + ps->v.pixelwidth / 2.0;
+    ps->v.ymaxlesshalf = base.centery + fullwidth / 2.0 - ps->v.pixelwidth / 2.0;
+
+    ps->level = level;
+    ps->tilesperside = tilesperside;
+    ps->parentclass = parentclass;
+    ps->tileclass = (unsigned char*) calloc( tilesperside * tilesperside, 1 );
+    if ( ps->tileclass == NULL ) {
+      printf( "\nNot enough memory.  Exiting.\n" );
+      ps->failed = 1;
+      break;
+    }
+
+    if ( !usetar ) {
+      char dirname[1024];
+      snprintf( dirname, sizeof(dirname), "%s/%d", outname, level );
+      int dirfailed = MakeDir( dirname ) != 0;
+      long tx;
+      for ( tx = 0; tx < tilesperside && !dirfailed; tx++ ) {
+        snprintf( dirname, sizeof(dirname), "%s/%d/%ld", outname, level, tx );
+        dirfailed = MakeDir( dirname ) != 0;
+      }
+      if ( dirfailed ) {
+        printf("Error: Could not create directory \"%s\": %s.  Exiting.\n\n", dirname, strerror( errno ) );
+        ps->failed = 1;
+        break;
+      }
+    }
+
+    ps->nexttile = 0;
+    ps->tilesdone = 0;
+    ps->tilesfilled = 0;
+    ps->pixelsiterated = 0;
+    ps->totaltiles = tilesperside * tilesperside;
+    ps->starttime = ps->lastreport = WallSeconds();
+
+    RunWorkers( threads, PyramidWorker, ps );
+
+    double elapsed = WallSeconds() - ps->starttime;
+    if ( elapsed <= 0.0 )
+      elapsed = 1e-9;
+    fprintf( stderr, "\rlevel %d: %ld tiles in %.2f s, %.1f tiles/s, %.2f Mpixels/s, %ld filled, %.1f%% of pixels iterated\n",
+             level, ps->tilesdone, elapsed, ps->tilesdone / elapsed,
+             ps->tilesdone * (double)( PYRAMIDTILESIZE * PYRAMIDTILESIZE ) / elapsed / 1e6, ps->tilesfilled,
+             100.0 * ps->pixelsiterated / ( (double) ps->totaltiles * PYRAMIDTILESIZE * PYRAMIDTILESIZE ) );
+    overalltiles += ps->tilesdone;
+    overallfilled += ps->tilesfilled;
+
+    free( parentclass );
+    parentclass = ps->tileclass;
+    ps->tileclass = NULL;
+  }
+  free( parentclass );
+
+  double elapsed = WallSeconds() - overallstart;
+  if ( elapsed <= 0.0 )
+    elapsed = 1e-9;
+  fprintf( stderr, "%ld tiles in %.2f s (%.1f tiles/s), %ld filled without iterating their inside.\n",
+           overalltiles, elapsed, overalltiles / elapsed, overallfilled );
+
+  int failed = ps->failed;
+  if ( ps->tarfile != NULL ) {
+    static const unsigned char zeroes[1024] = { 0 };
+    if ( fwrite( zeroes, 1, sizeof(zeroes), ps->tarfile ) != sizeof(zeroes) )
+      failed = 1;
+    if ( fclose( ps->tarfile ) != 0 )
+      failed = 1;
+  }
+#if defined(HAVE_PTHREADS)
+  pthread_mutex_destroy( &ps->lock );
+#endif
+  FreeColorMap( &ps->cm );
+  free( ps );
+
+  return failed ? -1 : 0;
+}
+
+/* Julia set sweep mode.                                                 */
+/*                                                                       */
+/* Renders a grid of Julia set thumbnails in one run.  The constant c of */
+/* the top left thumbnail is given with -j and that of the bottom right  */
+/* with -J, and -g sets the number of columns and rows.  The thumbnails  */
+/* go side by side into one contact sheet image, or each into its own    */
+/* file when -O gives a directory.                                       */
+/*                                                                       */
+/* Neighbouring thumbnails in a row are rendered together, SWEEPLANES at */
+/* a time: every pixel is iterated for all of their c values at once so  */
+/* the compiler can keep them in the lanes of one vector register.       */
+/*                                                                       */
+/* A c outside the Mandelbrot Set gives a disconnected Julia Set which   */
+/* is often next to empty.  Under "-s coarse" such sets are rendered at  */
+/* a fraction of the cost, and under "-s skip" they are left blank (and  */
+/* no file is written for them), unless a quick probe finds enough       */
+/* structure to be worth a full render.                                  */
+
+#define SWEEPLANES        4
+#define SWEEPPROBESTEP    8     // the dust probe looks at every 8th pixel each way
+#define SWEEPDUSTDEPTH    4     // probed pixels this many iterations past the critical point ...
+#define SWEEPDUSTRATIO    20    // ... number under 1 in 20 for the set to count as dust
+#define SWEEPCOARSESTEP   4     // a coarse render iterates 1 pixel in 4x4
+
+struct sweepstate
+{
+  struct view       v;          // the view of every thumbnail, less its c
+  long              cols;
+  long              rows;
+  double            c_r0;
+  double            c_i0;
+  double            c_rstep;
+  double            c_istep;
+  long              nextgroup;
+  long              groupsperrow;
+  int*              sheetk;     // cols*resolx by rows*resoly iteration counts, or NULL
+  const char*       outdir;     // per c files go here, or NULL
+  int               format;     // of the per c files
+  struct colormap   cm;
+  int               policy;
+  int               failed;
+  long              thumbsdone;
+  long              disconnected;
+  long              coarse;
+  long              skipped;
+};
+
+// Iterate pixel (x,y) of the view for SWEEPLANES different Julia constants together.
+static void IteratePixelLanes( const struct view* v, long x, long y, const double* c_r, const double* c_i,
+                               const double* a_r, const double* a_i, const double* a_radius2, int* kout ) {
+
+  double z_r[SWEEPLANES];
+  double z_i[SWEEPLANES];
+  double norm[SWEEPLANES];
+  int k[SWEEPLANES];
+  int capk = v->capk;
+  int l;
+
+  for ( l = 0; l < SWEEPLANES; l++ ) {
+    z_r[l] = v->xminplushalf + x * v->pixelwidth;
+    z_i[l] = v->ymaxlesshalf - y * v->pixelwidth;
+    norm[l] = 0.0;
+    k[l] = -1;
+  }
+
+  // Same steps as IteratePixel(), but a lane that has finished just stops
+  // updating instead of leaving the loop.  A lane without an attractor has
+  // a negative radius.
+  int running = 1;
+  while ( running ) {
+    running = 0;
+    for ( l = 0; l < SWEEPLANES; l++ ) {
+      int go = norm[l] < m && k[l] < capk;
+      double z_r_save = z_r[l];
+      double new_r = z_r_save * z_r_save - z_i[l] * z_i[l] + c_r[l];
+      double new_i = 2 * z_r_save * z_i[l] + c_i[l];
+      z_r[l] = go ? new_r : z_r[l];
+      z_i[l] = go ? new_i : z_i[l];
+      k[l] += go;
+      norm[l] = z_r[l] * z_r[l] + z_i[l] * z_i[l];
+      double d_r = z_r[l] - a_r[l];
+      double d_i = z_i[l] - a_i[l];
+      k[l] = go && d_r * d_r + d_i * d_i < a_radius2[l] ? capk : k[l];
+      running |= go;
+    }
+  }
+
+  for ( l = 0; l < SWEEPLANES; l++ )
+    kout[l] = k[l];
+}
+
+// x with its sign, in the fewest significant digits that read back as x.
+static void ShortestDouble( double x, char* text ) {
+
+  int precision;
+  for ( precision = 6; precision < 17; precision++ ) {
+    sprintf( text, "%+.*g", precision, x );
+    if ( strtod( text, NULL ) == x )
+      return;
+  }
+  sprintf( text, "%+.17g", x );
+}
+
+static int WriteThumbnail( const char* outdir, int format, double c_r, double c_i, const int* kbuf,
+                           const struct view* v, const struct colormap* cm ) {
+
+  // c in as few digits as read back the same, so however fine the sweep no two names are alike
+  char c_rtext[32], c_itext[32];
+  ShortestDouble( c_r, c_rtext );
+  ShortestDouble( c_i, c_itext );
+  char name[1024];
+  snprintf( name, sizeof(name), "%s/c%s%si.%s", outdir, c_rtext, c_itext, ImageExtension( format ) );
+
+  struct pixel* pixels = (struct pixel*) malloc( sizeof(struct pixel) * v->resolx * v->resoly );
+  if ( pixels == NULL )
+    return -1;
+  ColorPixels( kbuf, v->resolx * v->resoly, cm, pixels );
+  int failed = WriteImageFile( name, format, pixels, v->resolx, v->resoly ) != 0;
+  free( pixels );
+  return failed ? -1 : 0;
+}
+
+// Supplies the contact sheet rows to WriteImageBands().
+static void SheetRows( void* ctx, long y0, long rows, struct pixel* out ) {
+
+  struct sweepstate* ss = (struct sweepstate*) ctx;
+  long sheetx = ss->cols * ss->v.resolx;
+  ColorPixels( &ss->sheetk[y0 * sheetx], sheetx * rows, &ss->cm, out );
+}
+
+// The number of iterations before the critical point 0 escapes under z^2 + c, or capk.
+static int CriticalEscape( double c_r, double c_i, int capk ) {
+
+  double z_r = 0.0;
+  double z_i = 0.0;
+  int k = -1;
+  double norm = 0.0;
+
+  double z_r_save = z_r;
+  while ( norm < m && k < capk ) {
+    z_r_save = z_r;
+    z_r = z_r_save * z_r_save - z_i * z_i + c_r;
+    z_i = 2 * z_r_save * z_i + c_i;
+    k++;
+    norm = z_r * z_r + z_i * z_i;
+  }
+
+  return k;
+}
+
+// Decide how the Julia Set for c is rendered under the -s policy.
+//
+// If the critical point escapes (after n iterations) c is outside the
+// Mandelbrot Set and the Julia Set is disconnected dust.  Everything of
+// interest then lies inside the level curve of the critical point, where
+// points take longer than n iterations to escape, and each further
+// iteration splits that region in two smaller pieces around the dust.  A
+// coarse probe that finds few pixels a few levels down means the picture
+// is mostly empty.
+static int SweepKind( const struct view* v, double c_r, double c_i, int policy, int* disconnected ) {
+
+  int n = CriticalEscape( c_r, c_i, v->capk );
+  *disconnected = n < v->capk;
+  if ( !*disconnected || policy == SWEEPFULL )
+    return SWEEPFULL;
+
+  struct view jv = *v;
+  SetJuliaConstant( &jv, c_r, c_i );
+
+  long probed = 0;
+  long structured = 0;
+  long x, y;
+  for ( y = SWEEPPROBESTEP / 2; y < v->resoly; y += SWEEPPROBESTEP )
+    for ( x = SWEEPPROBESTEP / 2; x < v->resolx; x += SWEEPPROBESTEP ) {
+      probed++;
+      if ( IteratePixel( &jv, x, y ) > n + SWEEPDUSTDEPTH )
+        structured++;
+    }
+
+  if ( structured * SWEEPDUSTRATIO > probed )
+    return SWEEPFULL;
+  return policy;
+}
+
+// Render one pixel in every SWEEPCOARSESTEP x SWEEPCOARSESTEP block and copy it over the block.
+static void RenderCoarse( const struct view* v, double c_r, double c_i, int* kbuf ) {
+
+  struct view jv = *v;
+  SetJuliaConstant( &jv, c_r, c_i );
+
+  long bx, by, x, y;
+  for ( by = 0; by < v->resoly; by += SWEEPCOARSESTEP )
+    for ( bx = 0; bx < v->resolx; bx += SWEEPCOARSESTEP ) {
+      long sx = bx + SWEEPCOARSESTEP / 2 < v->resolx ? bx + SWEEPCOARSESTEP / 2 : v->resolx - 1;
+      long sy = by + SWEEPCOARSESTEP / 2 < v->resoly ? by + SWEEPCOARSESTEP / 2 : v->resoly - 1;
+      int k = IteratePixel( &jv, sx, sy );
+      for ( y = by; y < by + SWEEPCOARSESTEP && y < v->resoly; y++ )
+        for ( x = bx; x < bx + SWEEPCOARSESTEP && x < v->resolx; x++ )
+          kbuf[y * v->resolx + x] = k;
+    }
+}
+
+static void* SweepWorker( void* arg ) {
+
+  struct sweepstate* ss = (struct sweepstate*) arg;
+  const struct view* v = &ss->v;
+  long thumbpixels = v->resolx * v->resoly;
+
+  int* lanek = (int*) malloc( sizeof(int) * SWEEPLANES * thumbpixels );
+  if ( lanek == NULL ) {
+    ss->failed = 1;
+    return NULL;
+  }
+
+  long group;
+  while ( !ss->failed && ( group = NextWorkItem( &ss->nextgroup ) ) < ss->groupsperrow * ss->rows ) {
+    long row  = group / ss->groupsperrow;
+    long col0 = ( group % ss->groupsperrow ) * SWEEPLANES;
+    int thumbs = ss->cols - col0 < SWEEPLANES ? ss->cols - col0 : SWEEPLANES;
+
+    double thumbc_r[SWEEPLANES];
+    double thumbc_i[SWEEPLANES];
+    int kind[SWEEPLANES];
+    int fullthumb[SWEEPLANES];
+    int fullcount = 0;
+    long disconnected = 0;
+    int l;
+    for ( l = 0; l < thumbs; l++ ) {
+      int isdust;
+      thumbc_r[l] = ss->c_r0 + ( col0 + l ) * ss->c_rstep;
+      thumbc_i[l] = ss->c_i0 + row * ss->c_istep;
+      kind[l] = SweepKind( v, thumbc_r[l], thumbc_i[l], ss->policy, &isdust );
+      disconnected += isdust;
+      if ( kind[l] == SWEEPFULL )
+        fullthumb[fullcount++] = l;
+    }
+
+    // the thumbnails needing a full render share the lanes; spare lanes repeat the last one
+    if ( fullcount > 0 ) {
+      double c_r[SWEEPLANES];
+      double c_i[SWEEPLANES];
+      double a_r[SWEEPLANES];
+      double a_i[SWEEPLANES];
+      double a_radius2[SWEEPLANES];
+      for ( l = 0; l < SWEEPLANES; l++ ) {
+        int t = fullthumb[l < fullcount ? l : fullcount - 1];
+        struct view jv = *v;
+        SetJuliaConstant( &jv, thumbc_r[t], thumbc_i[t] );
+        c_r[l] = jv.c_r;
+        c_i[l] = jv.c_i;
+        a_r[l] = jv.attractor_r;
+        a_i[l] = jv.attractor_i;
+        a_radius2[l] = jv.hasattractor ? jv.attractorradius2 : -1.0;
+      }
+
+      long x, y;
+      for ( y = 0; y < v->resoly; y++ )
+        for ( x = 0; x < v->resolx; x++ ) {
+          int k[SWEEPLANES];
+          IteratePixelLanes( v, x, y, c_r, c_i, a_r, a_i, a_radius2, k );
+          for ( l = 0; l < fullcount; l++ )
+            lanek[fullthumb[l] * thumbpixels + y * v->resolx + x] = k[l];
+        }
+    }
+
+    long coarse = 0;
+    long skipped = 0;
+    for ( l = 0; l < thumbs; l++ ) {
+      int* thumbk = &lanek[l * thumbpixels];
+      if ( kind[l] == SWEEPCOARSE ) {
+        RenderCoarse( v, thumbc_r[l], thumbc_i[l], thumbk );
+        coarse++;
+      }
+      else if ( kind[l] == SWEEPSKIP ) {
+        memset( thumbk, 0, sizeof(int) * thumbpixels );  // as if every point escaped at once
+        skipped++;
+      }
+
+      if ( ss->sheetk != NULL ) {
+        long sheetwidth = ss->cols * v->resolx;
+        long left = ( col0 + l ) * v->resolx;
+        long top  = row * v->resoly;
+        long y;
+        for ( y = 0; y < v->resoly; y++ )
+          memcpy( &ss->sheetk[(top + y) * sheetwidth + left], &thumbk[y * v->resolx], sizeof(int) * v->resolx );
+      }
+      if ( ss->outdir != NULL && kind[l] != SWEEPSKIP &&
+           WriteThumbnail( ss->outdir, ss->format, thumbc_r[l], thumbc_i[l], thumbk, v, &ss->cm ) != 0 ) {
+        fprintf( stderr, "Error: Could not write the thumbnail for c = %f + %fi.\n", thumbc_r[l], thumbc_i[l] );
+        ss->failed = 1;
+      }
+    }
+
+    AtomicAdd( &ss->thumbsdone, thumbs );
+    AtomicAdd( &ss->disconnected, disconnected );
+    AtomicAdd( &ss->coarse, coarse );
+    AtomicAdd( &ss->skipped, skipped );
+  }
+
+  free( lanek );
+  return NULL;
+}
+
+// Render the sweep, writing the contact sheet to fpout unless it is NULL.
+int RunSweep( const struct options* opt, int threads, FILE* fpout, int sheetformat, const struct palette* pal ) {
+
+  struct sweepstate* ss = (struct sweepstate*) calloc( 1, sizeof(struct sweepstate) );
+  if ( ss == NULL ) {
+    printf( "\nNot enough memory.  Exiting.\n" );
+    return -1;
+  }
+
+  struct options thumbopt = *opt;
+  if ( !thumbopt.user_resolutionoverride ) {
+    thumbopt.user_resolx = SWEEPTHUMBX;
+    thumbopt.user_resoly = SWEEPTHUMBY;
+    thumbopt.user_resolutionoverride = 1;
+  }
+  SetupView( &thumbopt, &ss->v );
+
+  ss->cols = opt->user_sweepcols > 0 ? opt->user_sweepcols : 1;
+  ss->rows = opt->user_sweeprows > 0 ? opt->user_sweeprows : 1;
+  ss->c_r0 = opt->user_julia_r;
+  ss->c_i0 = opt->user_julia_i;
+  ss->c_rstep = ss->cols > 1 ? ( opt->user_julia2_r - opt->user_julia_r ) / ( ss->cols - 1 ) : 0.0;
+  ss->c_istep = ss->rows > 1 ? ( opt->user_julia2_i - opt->user_julia_i ) / ( ss->rows - 1 ) : 0.0;
+  ss->groupsperrow = ( ss->cols + SWEEPLANES - 1 ) / SWEEPLANES;
+  ss->outdir = opt->sweepdir;
+  ss->policy = opt->user_sweeppolicy;
+  ss->format = ImageFormat( opt->formatname, NULL );
+
+  if ( ss->v.resolx < 1 || ss->v.resoly < 1 ) {
+    printf( "Error: Bad thumbnail resolution.  Exiting.\n\n" );
+    free( ss );
+    return -1;
+  }
+
+  if ( MakeColorMap( pal, ss->v.capk, &ss->cm ) != 0 ) {
+    printf( "\nNot enough memory.  Exiting.\n" );
+    free( ss );
+    return -1;
+  }
+
+  if ( ss->outdir != NULL && MakeDir( ss->outdir ) != 0 ) {
+    printf( "Error: Could not create directory \"%s\": %s.  Exiting.\n\n", ss->outdir, strerror( errno ) );
+    FreeColorMap( &ss->cm );
+    free( ss );
+    return -1;
+  }
+
+  long sheetx = ss->cols * ss->v.resolx;
+  long sheety = ss->rows * ss->v.resoly;
+  if ( fpout != NULL ) {
+    ss->sheetk = (int*) malloc( sizeof(int) * sheetx * sheety );
+    if ( ss->sheetk == NULL ) {
+      printf( "\nNot enough memory.  Exiting.\n" );
+      FreeColorMap( &ss->cm );
+      free( ss );
+      return -1;
+    }
+  }
+
+  double starttime = WallSeconds();
+  RunWorkers( threads, SweepWorker, ss );
+  double elapsed = WallSeconds() - starttime;
+  if ( elapsed <= 0.0 )
+    elapsed = 1e-9;
+
+  // the self test keeps its own output to the pass or fail of each scene
+  if ( !opt->selftest ) {
+    fprintf( stderr, "%ld Julia sets in %.2f s, %.1f per second.\n", ss->thumbsdone, elapsed, ss->thumbsdone / elapsed );
+    fprintf( stderr, "%ld disconnected: %ld rendered coarse, %ld skipped.\n", ss->disconnected, ss->coarse, ss->skipped );
+  }
+
+  int failed = ss->failed;
+  if ( ss->sheetk != NULL && !failed )
+    failed = WriteImageBands( fpout, sheetformat, sheetx, sheety, threads, SheetRows, ss ) != 0;
+
+  FreeColorMap( &ss->cm );
+  free( ss->sheetk );
+  free( ss );
+  return failed ? -1 : 0;
+}
+
+/* Self test.                                                            */
+/*                                                                       */
+/* --selftest renders a few reference scenes with --deterministic, once  */
+/* on one thread and once on several, and checks a hash of each image    */
+/* against the one recorded here.  With --deterministic, the attractor   */
+/* shortcut (which takes sin() and cos() from the math library) is left  */
+/* out, and a * b + c is never fused anywhere (see the top of the file), */
+/* so an image is the same bits whatever the thread count, compiler      */
+/* target or sweep lane width.  A scene that fails means a change to the */
+/* iteration or coloring code changed the images.                        */
+
+struct selftestscene
+{
+  const char*           name;
+  const char*           args;
+  unsigned long long    hash;   // FNV-1a of the PPM
+};
+
+static const struct selftestscene SelfTestScenes[] = {
+  { "mandelbrot",       "-r 256,192",                                       0x7ce72686a004d495ULL },
+  { "julia",            "-r 256,192 -j -.194,.6557",                        0x1472198aaaa96867ULL },
+  { "seahorse valley",  "-r 200,150 -z 50 -c -0.743643,0.131825 -m 5000",   0xe9e746e5dfd83456ULL },
+  { "rabbit",           "-r 200,150 -j -0.1226,0.7449 -m 4000",             0xb0187e837eeaa03aULL },
+  { "julia sweep",      "-r 40,30 -j -0.8,0.156 -J -0.7,0.3 -g 5,3",        0x41ff876a0ecd8d88ULL },
+  { "equalized fire",   "-r 160,120 -p fire --equalize -m 1000",            0x9cab5c8fd8ffeb4aULL }
+};
+
+// Render a self test scene with threads workers, returning the hash of the PPM in *hash.
+static int RenderSelfTestScene( const char* args, int threads, unsigned long long* hash ) {
+
+  char line[256];
+  char* argv[32];
+  int argc = 0;
+  snprintf( line, sizeof(line), "%s", args );
+  argv[argc++] = (char*) "fractals";
+  char* token = strtok( line, " " );
+  while ( token != NULL && argc < 32 ) {
+    argv[argc++] = token;
+    token = strtok( NULL, " " );
+  }
+
+  struct options opt;
+  ParseOptions( argc, argv, &opt );
+  opt.deterministic = 1;
+  opt.selftest = 1;  // which keeps the sweep from printing its stats
+  struct view v;
+  SetupView( &opt, &v );
+
+  FILE* fp = tmpfile();
+  struct palette pal;
+  int failed = fp == NULL || LoadPalette( opt.palettename, 0, &pal ) != 0;
+  if ( !failed ) {
+    if ( opt.MakeJuliaSweep )
+      failed = RunSweep( &opt, threads, fp, IMAGEPPM, &pal ) != 0;
+    else if ( opt.equalize )
+      failed = RenderEqualized( &v, &pal, threads, fp, IMAGEPPM, NULL ) != 0;
+    else {
+      struct colormap cm;
+      failed = MakeColorMap( &pal, v.capk, &cm ) != 0;
+      if ( !failed ) {
+        struct renderrows rr = { &v, &cm };
+        failed = WriteImageBands( fp, IMAGEPPM, v.resolx, v.resoly, threads, RenderRows, &rr ) != 0;
+        FreeColorMap( &cm );
+      }
+    }
+    FreePalette( &pal );
+  }
+  FreeOptions( &opt );
+
+  unsigned long long h = 14695981039346656037ULL;
+  if ( !failed ) {
+    rewind( fp );
+    unsigned char buf[65536];
+    size_t got;
+    while ( ( got = fread( buf, 1, sizeof(buf), fp ) ) > 0 ) {
+      size_t i;
+      for ( i = 0; i < got; i++ )
+        h = ( h ^ buf[i] ) * 1099511628211ULL;
+    }
+    failed = ferror( fp );
+  }
+  if ( fp != NULL )
+    fclose( fp );
+  *hash = h;
+  return failed ? -1 : 0;
+}
+
+int RunSelfTest( int threads ) {
+
+  int manythreads = threads > 1 ? threads : 4;
+  int failures = 0;
+  unsigned int i;
+  for ( i = 0; i < sizeof(SelfTestScenes) / sizeof(SelfTestScenes[0]); i++ ) {
+    const struct selftestscene* scene = &SelfTestScenes[i];
+    int pass;
+    for ( pass = 0; pass < 2; pass++ ) {
+      int t = pass == 0 ? 1 : manythreads;
+      unsigned long long hash = 0;
+      int ok = RenderSelfTestScene( scene->args, t, &hash ) == 0 && hash == scene->hash;
+      printf( "%-16s %2d thread%s  %016llx  %s\n", scene->name, t, t == 1 ? " " : "s", hash, ok ? "ok" : "FAILED" );
+      if ( !ok )
+        failures++;
+    }
+  }
+
+  if ( failures > 0 ) {
+    printf( "%d of the self tests failed.\n", failures );
+    return -1;
+  }
+  printf( "All the self tests passed.\n" );
+  return 0;
+}
@@ -5,16 +5,61 @@
 
 /* To compile, the GMP library needs to be already installed.    */
 /* See https://gmplib.org                                        */
-/* On linux, try:  gcc ptriples.cpp -lgmp -o ptriples            */
+/* On linux, try:  gcc ptriples.cpp -lgmp -pthread -o ptriples   */
+
+/* Ranges that fit in 64 bit (or, with gcc and clang, 128 bit)   */
+/* integers are done with machine integers.  GMP only does the   */
+/* ranges above that.                                            */
 
 /* A great source of info is the Wikipedia page:      */
 /* http://en.wikipedia.org/wiki/Pythagorean_triple    */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <gmp.h>
 
+#if defined(_WIN32) && !defined(__CYGWIN__)
+#include <fcntl.h>
+#include <io.h>
+#else
+#define HAVE_PTHREADS 1
+#include <pthread.h>
+#endif
+
+#define MEMORY            64            // default megabytes a window of triples may take
+#define CACHEDPRIMITIVES  ( 1L << 20 )  // about how many small primitive triples are kept
+#define MAXTHREADS        256
+#define SIEVEBLOCK        ( 1L << 16 )  // how many numbers are sieved at a time
+#define SIEVEDFACTORS     ( 1L << 22 )  // the n up to which prime factors are sieved
+#define SIEVEDPRIMES      ( 1L << 24 )  // how far up --histogram keeps the primes
+#define OUTPUTBUFFER      ( 1L << 20 )  // bytes of output written at a time
+#define BINBLOCK          ( 1L << 18 )  // most bytes in each column of a --format=bin block
+
+#define FORMATTEXT   0    // output formats
+#define FORMATCSV    1
+#define FORMATTSV    2
+#define FORMATBIN    3
+
+#if defined(__SIZEOF_INT128__)
+#define HAVE_UINT128 1
+typedef unsigned __int128 uint128_t;
+#endif
+
+
+// The triples are written through a buffer.  For bin, they are first
+// gathered into a block of columns.
+struct output {
+int              format;
+size_t           count;
+unsigned char    buffer[OUTPUTBUFFER];
+long             rows;      // triples in the bin block
+size_t           width;     // bytes each of their numbers takes
+unsigned char    columns[3][BINBLOCK];  // a, b and c
+};
+
+struct output Output;
 
 struct tentry {
   mpz_t a;
@@ -22,37 +67,202 @@ struct tentry {
   mpz_t c;
 };
 
+// Triples in machine integers of type T, a column each for a, b and c.
+template <typename T> struct wtable {
+long             count;
+long             size;
+T*               a;
+T*               b;
+T*               c;
+};
+
+// The triples with c below 2^64 go in words, and only the rest in GMP
+// integers.  Those are set up as the table grows and reused after that.
 struct ttable {
+struct wtable<uint64_t>  words;
 long             count;
+long             size;
 struct tentry*   triples;
 };
 
-void AddPTriple( struct ttable*, mpz_t, mpz_t, mpz_t );
+int GenerateTriplesGMP( mpz_t, mpz_t, int );
+void SiftRunDown( int*, int, int, int (*)( const void*, int, int ), const void* );
+int AddPTriple( struct ttable*, mpz_t, mpz_t, mpz_t );
 void Cleanup_ttable( struct ttable* );
 int ttable_entry_cmpfunc( const void*, const void* );
 
+// A node of the Berggren tree, as Euclid's (m,n)
+template <typename T> struct wnode {
+  T m;
+  T n;
+  T c;
+  int depth;  // levels down from the root, or the split for all below it
+};
+
+// Where a walk of the tree for one k is up to: the nodes it has reached but
+// not yet taken, whose c are past the last window
+template <typename T> struct wfrontier {
+struct wnode<T>*  heap;      // a min-heap by c
+long             count;
+long             size;
+int              seeded;
+};
+
+// One thread's share of a window of c values: every parts'th n of each scan
+// of (m,n), and every parts'th cached primitive, from number part.
+template <typename T> struct wwork {
+struct wtable<T>         triples;   // its sorted run
+const struct wtable<T>*  cached;
+const uint32_t*  spf;       // the smallest prime factor of each n up to spfmax
+uint32_t         spfmax;
+T                lo;
+T                hi;
+T                cachebound;
+T                c_max;
+struct wfrontier<T>*  frontiers;  // with --tree, the walk for each k, from 1
+long             frontiercount;
+int              DoOnlyPrimitives;
+int              DoTree;
+int              part;
+int              parts;
+int              failed;
+};
+
+// Where each thread's run is up to, as they are merged
+template <typename T> struct wmerge {
+const struct wwork<T>*   work;
+long             next[MAXTHREADS];
+};
+
+template <typename T> int GenerateTriples( T, T, int, int, int, size_t );
+template <typename T> void FillWindow( struct wwork<T>* );
+template <typename T> int AddWindowPrimitives( struct wwork<T>*, T, T, T );
+template <typename T> void* WindowWorker( void* );
+template <typename T> int AddPrimitives( struct wtable<T>*, T, T, T, T, T, const uint32_t*, uint32_t );
+template <typename T> int AddTreePrimitives( struct wtable<T>*, struct wfrontier<T>*, T, T, T, T, int, int );
+template <typename T> int PushWNode( struct wfrontier<T>*, struct wnode<T> );
+template <typename T> struct wnode<T> PopWNode( struct wfrontier<T>* );
+template <typename T> void PrintWTriples( const struct wtable<T>* );
+template <typename T> void MergeWTriples( const struct wwork<T>*, int );
+template <typename T> int WRunLess( const void*, int, int );
+template <typename T> void PrintWTriple( T, T, T );
+template <typename T> void PutBytes( unsigned char*, T, size_t );
+void PrintPTriple( mpz_t, mpz_t, mpz_t );
+void StartOutput( int );
+size_t BinRow( size_t );
+void EndBinBlock( void );
+void PutLE64( unsigned char*, uint64_t );
+unsigned char* OutputSpace( size_t );
+void WriteOutput( void );
+void FlushOutput( void );
+template <typename T> int AddWTriple( struct wtable<T>*, T, T, T );
+template <typename T> void SortWTriples( struct wtable<T>* );
+template <typename T> void SortWRange( struct wtable<T>*, long, long, int );
+template <typename T> void HeapSortWRange( struct wtable<T>*, long, long );
+template <typename T> void SiftWDown( struct wtable<T>*, long, long, long );
+template <typename T> void FreeWTable( struct wtable<T>* );
+template <typename T> T MpzToWord( mpz_t );
+template <typename T> T WordSqrt( T );
+template <typename T> char* WordToStr( T, char* );
+char* U64ToStr( uint64_t, char* );
+uint64_t WordGCD( uint64_t, uint64_t );
+
+// For sieving the Mobius function over odd d, a block at a time
+struct mobius {
+uint32_t*        primes;    // the primes up to the root of the largest d
+long             count;
+signed char*     mu;
+uint64_t*        rest;
+};
+
+int CountTriples( uint64_t, uint64_t, int );
+int CountUpTo( mpz_t, uint64_t, int );
+uint64_t CountPrimitivesUpTo( struct mobius*, uint64_t );
+uint64_t CountEuclidPairs( uint64_t );
+int HistogramTriples( uint64_t, uint64_t, int );
+uint32_t* SievePrimes( uint64_t, long* );
+void SieveSegment( uint64_t, long, const uint32_t*, long, char* );
+void SieveOutPrime( uint64_t, uint64_t, long, uint64_t*, uint64_t*, int );
+uint32_t* SieveFactors( uint32_t );
+
 
 int main( int argc, char * argv[] ) {
 
-  if ( argc != 3 && argc != 4 ) {
+  int DoOnlyPrimitives = 0;
+  int DoCount = 0;
+  int DoHistogram = 0;
+  int DoTree = 0;
+  int format = FORMATTEXT;
+  int formatted = 0;
+  int threads = 1;
+  long memory = MEMORY;
+  int badargs = argc < 3;
+  int i;
+  for ( i = 1; i < argc - 2 && !badargs; i++ ) {
+    if ( strcmp( argv[i], "-p" ) == 0 )
+      DoOnlyPrimitives = 1;
+    else if ( strcmp( argv[i], "--count" ) == 0 )
+      DoCount = 1;
+    else if ( strcmp( argv[i], "--histogram" ) == 0 )
+      DoHistogram = 1;
+    else if ( strcmp( argv[i], "--tree" ) == 0 )
+      DoTree = 1;
+    else if ( strcmp( argv[i], "--format=text" ) == 0 )
+      format = FORMATTEXT, formatted = 1;
+    else if ( strcmp( argv[i], "--format=csv" ) == 0 )
+      format = FORMATCSV, formatted = 1;
+    else if ( strcmp( argv[i], "--format=tsv" ) == 0 )
+      format = FORMATTSV, formatted = 1;
+    else if ( strcmp( argv[i], "--format=bin" ) == 0 )
+      format = FORMATBIN, formatted = 1;
+    else if ( strcmp( argv[i], "-t" ) == 0 && i + 1 < argc - 2 && atoi( argv[i + 1] ) >= 1 )
+      threads = atoi( argv[++i] );
+    else if ( strcmp( argv[i], "-M" ) == 0 && i + 1 < argc - 2 && atol( argv[i + 1] ) >= 1 )
+      memory = atol( argv[++i] );
+    else
+      badargs = 1;
+  }
+  if ( threads > MAXTHREADS )
+    threads = MAXTHREADS;
+
+  if ( badargs ) {
     printf("\n");
     printf("For a^2 + b^2 = c^2 :\n");
     printf("\n");
-    printf("Usage: ptriples [-p] c_min c_max\n\n\n");
+    printf("Usage: ptriples [-p] [-t threads] [-M megabytes]\n");
+    printf("                [--tree] [--format=f] [--count | --histogram] c_min c_max\n\n\n");
     printf("Options:\n\n");
-    printf("  -p -- primitive triples only\n\n");
+    printf("  -p -- primitive triples only\n");
+    printf("  -t -- threads to generate them with, below 2^128 (default 1)\n");
+    printf("  -M -- about how many megabytes each window of triples being sorted may\n");
+    printf("        take, below 2^128 (default %d)\n", MEMORY );
+    printf("  --tree -- walk the Berggren tree of primitive triples, below 2^128,\n");
+    printf("            rather than scan (m,n).  Each window carries on the walk\n");
+    printf("            from where the last left off, but the nodes waiting past it\n");
+    printf("            take memory that grows with c_max, on top of -M.\n");
+    printf("  --format -- text (a,b,c) lines, csv, tsv, or bin: after the 16 bytes\n");
+    printf("              \"ptriples\" and 2, blocks of columns.  Each block is n, the\n");
+    printf("              triples in it, and w, the bytes per number, then n a's,\n");
+    printf("              n b's and n c's of w bytes each.  w is 8 below 2^64 and a\n");
+    printf("              multiple of 8 past it.  All of it is little endian.\n");
+    printf("  --count -- only how many triples there are, below 2^64\n");
+    printf("  --histogram -- only each c and how many triples have it, below 2^64,\n");
+    printf("                 as text.  Not with --count or --format.\n\n");
     return 1;
   }
 
-  int DoOnlyPrimitives = 0;
-  if ( argc == 4 && strcmp( argv[1], "-p" ) == 0 )
-    DoOnlyPrimitives = 1;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+  if ( format == FORMATBIN && _setmode( _fileno( stdout ), _O_BINARY ) == -1 ) {
+    printf( "Cannot set stdout to binary mode.  Exiting." );
+    return -1;
+  }
+#endif
 
   mpz_t user_c_min;
-  mpz_init_set_str( user_c_min,  argv[argc == 3 ? 1 : 2], 10 );
+  mpz_init_set_str( user_c_min,  argv[argc - 2], 10 );
 
   mpz_t user_c_max;
-  mpz_init_set_str( user_c_max,  argv[argc == 3 ? 2 : 3], 10 );
+  mpz_init_set_str( user_c_max,  argv[argc - 1], 10 );
 
   if ( mpz_cmp_ui( user_c_min, 1 ) < 0 ) {
     printf("\nc_min must be >= 1.  Aborting.\n\n");
@@ -68,6 +278,52 @@ int main( int argc, char * argv[] ) {
     return 1;
   }
 
+  if ( DoCount && DoHistogram ) {
+    printf("\n--count and --histogram can't both be given.  Aborting.\n\n");
+    mpz_clear( user_c_max );
+    mpz_clear( user_c_min );
+    return 1;
+  }
+
+  if ( ( DoCount || DoHistogram ) && formatted ) {
+    printf("\n--format is for the triples, not --count or --histogram.  Aborting.\n\n");
+    mpz_clear( user_c_max );
+    mpz_clear( user_c_min );
+    return 1;
+  }
+
+  StartOutput( format );
+
+  // use the widest machine integers needed, and GMP only past those
+  int retval;
+  size_t bits = mpz_sizeinbase( user_c_max, 2 );
+  if ( ( DoCount || DoHistogram ) && bits > 64 ) {
+    printf("\n--count and --histogram need c_max < 2^64.  Aborting.\n\n");
+    retval = 1;
+  }
+  else if ( DoHistogram )
+    retval = HistogramTriples( MpzToWord<uint64_t>( user_c_min ), MpzToWord<uint64_t>( user_c_max ), DoOnlyPrimitives );
+  else if ( DoCount )
+    retval = CountTriples( MpzToWord<uint64_t>( user_c_min ), MpzToWord<uint64_t>( user_c_max ), DoOnlyPrimitives );
+  else if ( bits <= 64 )
+    retval = GenerateTriples<uint64_t>( MpzToWord<uint64_t>( user_c_min ), MpzToWord<uint64_t>( user_c_max ), DoOnlyPrimitives, DoTree, threads, (size_t) memory << 20 );
+#if defined(HAVE_UINT128)
+  else if ( bits <= 128 )
+    retval = GenerateTriples<uint128_t>( MpzToWord<uint128_t>( user_c_min ), MpzToWord<uint128_t>( user_c_max ), DoOnlyPrimitives, DoTree, threads, (size_t) memory << 20 );
+#endif
+  else
+    retval = GenerateTriplesGMP( user_c_min, user_c_max, DoOnlyPrimitives );
+  FlushOutput();
+
+  mpz_clear( user_c_max );
+  mpz_clear( user_c_min );
+
+  return retval;
+}
+
+// Generate, sort and print the triples with GMP integers.
+int GenerateTriplesGMP( mpz_t user_c_min, mpz_t user_c_max, int DoOnlyPrimitives ) {
+
   mpz_t working_c_min;
   if ( DoOnlyPrimitives )
     mpz_init_set( working_c_min, user_c_min );
@@ -83,8 +339,8 @@ int main( int argc, char * argv[] ) {
   // an odd number to guarantee that the triple is primitive.
 
   struct ttable triples;
-  triples.count = 0;
-  triples.triples = NULL;
+  memset( &triples, 0, sizeof(triples) );
+  int failed = 0;
 
   mpz_t a;
   mpz_init( a );
@@ -133,7 +389,7 @@ int main( int argc, char * argv[] ) {
   mpz_init( kc );
 
   // iterate through n
-  for ( mpz_set_ui( n, 1 );  mpz_cmp( n, n_max ) <= 0; mpz_add_ui( n, n, 1 ) ) {
+  for ( mpz_set_ui( n, 1 );  mpz_cmp( n, n_max ) <= 0 && !failed; mpz_add_ui( n, n, 1 ) ) {
     mpz_mul( n_squared, n, n );
 
     // compute m_min
@@ -163,7 +419,7 @@ int main( int argc, char * argv[] ) {
     }
 
     // iterate through m
-    for ( ; mpz_cmp( m, m_max ) <= 0; mpz_add_ui( m, m, 2 ) ) {
+    for ( ; mpz_cmp( m, m_max ) <= 0 && !failed; mpz_add_ui( m, m, 2 ) ) {
 
       // generate a primitive (a,b,c)
       mpz_gcd( gcd, m, n );
@@ -186,12 +442,12 @@ int main( int argc, char * argv[] ) {
         continue;
 
       if ( DoOnlyPrimitives )
-        AddPTriple( &triples, a, b, c );
+        failed = AddPTriple( &triples, a, b, c );
       else {
         // iterate through k in: (k*a)^2 + (k*b)^2 = (k*c)^2
         mpz_fdiv_q( k, user_c_min, c );
 
-        for ( mpz_mul( kc, c, k ); mpz_cmp( kc, user_c_max ) <= 0; mpz_add_ui( k, k, 1 ), mpz_mul( kc, c, k ) ) {
+        for ( mpz_mul( kc, c, k ); mpz_cmp( kc, user_c_max ) <= 0 && !failed; mpz_add_ui( k, k, 1 ), mpz_mul( kc, c, k ) ) {
 
           if ( mpz_cmp( kc, user_c_min ) < 0 )
             continue;
@@ -199,7 +455,7 @@ int main( int argc, char * argv[] ) {
           mpz_mul( ka, a, k );
           mpz_mul( kb, b, k );
 
-          AddPTriple( &triples, ka, kb, kc );
+          failed = AddPTriple( &triples, ka, kb, kc );
         }
       }
     }
@@ -210,12 +466,22 @@ int main( int argc, char * argv[] ) {
   mpz_clear( ka );
   mpz_clear( k );
 
-  qsort( triples.triples, triples.count, sizeof(struct tentry), ttable_entry_cmpfunc );
+  if ( failed ) {
+    FlushOutput();
+    printf("\nNot enough memory.  Aborting.\n\n");
+  }
+  else {
+    // every c in words is below every c in GMP integers
+    SortWTriples<uint64_t>( &triples.words );
+    qsort( triples.triples, triples.count, sizeof(struct tentry), ttable_entry_cmpfunc );
+
+    // print
+    PrintWTriples<uint64_t>( &triples.words );
+    long i;
+    for ( i = 0; i < triples.count; i++ )
+      PrintPTriple( triples.triples[i].a, triples.triples[i].b, triples.triples[i].c );
+  }
 
-  // print
-  long i;
-  for ( i = 0; i < triples.count; i++ )
-    gmp_printf("(%Zd,%Zd,%Zd)\n", triples.triples[i].a, triples.triples[i].b, triples.triples[i].c );
 
   mpz_clear( tempZ );
   mpz_clear( gcd );
@@ -233,31 +499,40 @@ int main( int argc, char * argv[] ) {
   Cleanup_ttable( &triples );
 
   mpz_clear( working_c_min );
-  mpz_clear( user_c_max );
-  mpz_clear( user_c_min );
 
-  return 0;
+  return failed ? 1 : 0;
 }
 
-// Add an entry to TABLE2
-void AddPTriple( struct ttable* the_ttable, mpz_t a, mpz_t b, mpz_t c ) {
-
-  // allocate memory
-  long index = 0;
-  if ( the_ttable->count == 0 ) {
-    the_ttable->count = 1;
-    the_ttable->triples = (struct tentry*) calloc( 1, sizeof(struct tentry) );
-  }
-  else {
-    the_ttable->count++;
-    the_ttable->triples = (struct tentry*) realloc( the_ttable->triples, sizeof(struct tentry) * the_ttable->count );
-    index = the_ttable->count - 1;
-    memset( &the_ttable->triples[index], 0, sizeof(struct tentry) );
+// Add an entry, smaller leg first.  Returns nonzero if there is no memory for it.
+int AddPTriple( struct ttable* the_ttable, mpz_t a, mpz_t b, mpz_t c ) {
+
+  mpz_ptr leg1 = mpz_cmp( a, b ) < 0 ? a : b;
+  mpz_ptr leg2 = mpz_cmp( a, b ) < 0 ? b : a;
+
+  // a and b are below c, so they fit whenever c does
+  if ( mpz_sizeinbase( c, 2 ) <= 64 )
+    return AddWTriple<uint64_t>( &the_ttable->words, MpzToWord<uint64_t>( leg1 ), MpzToWord<uint64_t>( leg2 ), MpzToWord<uint64_t>( c ) );
+
+  if ( the_ttable->count == the_ttable->size ) {
+    long size = the_ttable->size > 0 ? the_ttable->size * 2 : 64;
+    struct tentry* triples = (struct tentry*) realloc( the_ttable->triples, sizeof(struct tentry) * size );
+    if ( triples == NULL )
+      return 1;
+    long i;
+    for ( i = the_ttable->size; i < size; i++ ) {
+      mpz_init( triples[i].a );
+      mpz_init( triples[i].b );
+      mpz_init( triples[i].c );
+    }
+    the_ttable->triples = triples;
+    the_ttable->size = size;
   }
 
-  mpz_init_set( the_ttable->triples[index].a, mpz_cmp( a, b ) < 0 ? a : b );
-  mpz_init_set( the_ttable->triples[index].b, mpz_cmp( a, b ) < 0 ? b : a );
-  mpz_init_set( the_ttable->triples[index].c, c );
+  struct tentry* entry = &the_ttable->triples[the_ttable->count++];
+  mpz_set( entry->a, leg1 );
+  mpz_set( entry->b, leg2 );
+  mpz_set( entry->c, c );
+  return 0;
 }
 
 // Free the memory allocated
@@ -266,8 +541,10 @@ void Cleanup_ttable( struct ttable* the_ttable ) {
   if ( the_ttable == NULL )
     return;
 
+  FreeWTable<uint64_t>( &the_ttable->words );
+
   long i;
-  for ( i = 0; i < the_ttable->count; i++ ) {
+  for ( i = 0; i < the_ttable->size; i++ ) {
     mpz_clear( the_ttable->triples[i].a );
     mpz_clear( the_ttable->triples[i].b );
     mpz_clear( the_ttable->triples[i].c );
@@ -279,6 +556,7 @@ void Cleanup_ttable( struct ttable* the_ttable ) {
   }
 
   the_ttable->count = 0;
+  the_ttable->size = 0;
 }
 
 int ttable_entry_cmpfunc( const void* p1, const void* p2 ) {
@@ -293,4 +571,1236 @@ int ttable_entry_cmpfunc( const void* p1, const void* p2 ) {
   return cmpval;
 }
 
+// Move heap[i] down a heap of count runs, in the order less( runs, r1, r2 ) gives.
+void SiftRunDown( int* heap, int count, int i, int (*less)( const void*, int, int ), const void* runs ) {
+
+  int child;
+  while ( ( child = 2 * i + 1 ) < count ) {
+    if ( child + 1 < count && less( runs, heap[child + 1], heap[child] ) )
+      child++;
+    if ( !less( runs, heap[child], heap[i] ) )
+      break;
+    int r = heap[i];
+    heap[i] = heap[child];
+    heap[child] = r;
+    i = child;
+  }
+}
+
+// With c_max below 2^64 (or 2^128), every m, n, a, b, c and k*c fits in a
+// machine integer: m^2 and n^2 are each no more than c_max, and so are
+// 2mn <= m^2 + n^2 = c and k*c.
+
+// The triples are made, sorted and printed a window of c values at a time,
+// each window sized to hold about as many of them as fit in -M megabytes, so
+// memory stays bounded however large the range is.  Every triple in a window is k times a
+// primitive one with c in the window divided by k.  The primitives with c up
+// to CACHEDPRIMITIVES * 6 (about 1 in 2 pi numbers is the c of one) are kept
+// in a list, since they have multiples in window after window.  Past that, k
+// is small and each k gets its own scan of (m,n) for c in the window / k.
+
+// With threads, each takes every threads'th n (the m ranges shrink as n grows,
+// so interleaving shares the work out evenly), sorts what it made, and the
+// sorted runs are merged as they are printed.
+
+// With --tree, the primitives come from walking the Berggren tree instead,
+// which makes only primitive (m,n), so needs no GCDs.  c only goes up down
+// the tree, so the nodes reached but past a window are kept in a heap by c
+// for each k, and the next window carries on from them.  Each node is taken
+// once over the whole range, but the heaps hold the nodes out to several
+// times the c reached, so they grow with c_max.  The threads split the tree
+// by subtree.
+
+// Generate, sort and print the triples with T integers.  c_max must fit in a T.
+template <typename T> int GenerateTriples( T c_min, T c_max, int DoOnlyPrimitives, int DoTree, int threads, size_t memory ) {
+
+#if !defined(HAVE_PTHREADS)
+  threads = 1;
+#endif
+
+  struct wtable<T> cached;
+  memset( &cached, 0, sizeof(cached) );
+
+  // the n of the (m,n) scans go up to (c_max / 2)^(1/2)
+  T n_max = WordSqrt<T>( c_max / 2 );
+  uint32_t spfmax = n_max < (T) SIEVEDFACTORS ? (uint32_t) n_max : (uint32_t) SIEVEDFACTORS;
+  uint32_t* spf = DoTree ? NULL : SieveFactors( spfmax );
+  if ( spf == NULL )
+    spfmax = 0;
+
+  T cachebound = 0;
+  int failed = 0;
+  if ( !DoOnlyPrimitives ) {
+    cachebound = c_max < (T) CACHEDPRIMITIVES * 6 ? c_max : (T) CACHEDPRIMITIVES * 6;
+    if ( DoTree ) {
+      struct wfrontier<T> frontier;
+      memset( &frontier, 0, sizeof(frontier) );
+      failed = AddTreePrimitives<T>( &cached, &frontier, 1, cachebound, cachebound, 1, 0, 1 );
+      free( frontier.heap );
+    }
+    else
+      failed = AddPrimitives<T>( &cached, 1, cachebound, 1, 1, 1, spf, spfmax );
+  }
+
+  struct wwork<T>* work = (struct wwork<T>*) calloc( threads, sizeof(struct wwork<T>) );
+  if ( work == NULL )
+    failed = 1;
+  int i;
+  for ( i = 0; i < threads && !failed; i++ ) {
+    work[i].cached = &cached;
+    work[i].cachebound = cachebound;
+    work[i].c_max = c_max;
+    work[i].spf = spf;
+    work[i].spfmax = spfmax;
+    work[i].DoOnlyPrimitives = DoOnlyPrimitives;
+    work[i].DoTree = DoTree;
+    work[i].part = i;
+    work[i].parts = threads;
+  }
+
+  // 3 T for each triple, in tables that can be twice what is in them
+  T windowtriples = (T)( memory / ( 6 * sizeof(T) ) );
+  if ( windowtriples < 64 )
+    windowtriples = 64;
+
+  // about 1 in 2 pi numbers is the c of a primitive triple, and ln(c) times that of any triple
+  T width = windowtriples * 6;
+  T lo = c_min;
+  while ( !failed ) {
+    if ( !DoOnlyPrimitives ) {
+      // ln(c), with windows near the start sized as if further on
+      int bits = 0;
+      T t;
+      for ( t = lo > windowtriples * 3 ? lo : windowtriples * 3; t != 0; t >>= 1 )
+        bits++;
+      width = windowtriples * 60 / ( 7 * bits + 10 );
+    }
+    T hi = c_max - lo < width ? c_max : lo + width - 1;
+
+    for ( i = 0; i < threads; i++ ) {
+      work[i].lo = lo;
+      work[i].hi = hi;
+    }
+
+    if ( threads == 1 )
+      FillWindow<T>( &work[0] );
+#if defined(HAVE_PTHREADS)
+    else {
+      pthread_t tids[MAXTHREADS];
+      int started;
+      for ( started = 0; started < threads; started++ )
+        if ( pthread_create( &tids[started], NULL, WindowWorker<T>, &work[started] ) != 0 )
+          break;
+      // any that would not start are done here
+      for ( i = started; i < threads; i++ )
+        FillWindow<T>( &work[i] );
+      for ( i = 0; i < started; i++ )
+        pthread_join( tids[i], NULL );
+    }
+#endif
+
+    for ( i = 0; i < threads; i++ )
+      failed |= work[i].failed;
+
+    if ( !failed ) {
+      if ( threads == 1 )
+        PrintWTriples<T>( &work[0].triples );
+      else
+        MergeWTriples<T>( &work[0], threads );
+      EndBinBlock();  // a window's triples go in blocks of their own
+    }
+
+    if ( hi == c_max )
+      break;
+    lo = hi + 1;
+  }
+
+  if ( failed ) {
+    FlushOutput();
+    printf("\nNot enough memory.  Aborting.\n\n");
+  }
+
+  if ( work != NULL ) {
+    for ( i = 0; i < threads; i++ ) {
+      FreeWTable<T>( &work[i].triples );
+      long j;
+      for ( j = 0; j < work[i].frontiercount; j++ )
+        free( work[i].frontiers[j].heap );
+      free( work[i].frontiers );
+    }
+    free( work );
+  }
+  FreeWTable<T>( &cached );
+  free( spf );
+  return failed ? 1 : 0;
+}
+
+// Make and sort one thread's share of the triples with c in [lo, hi].
+template <typename T> void FillWindow( struct wwork<T>* w ) {
+
+  T lo = w->lo;
+  T hi = w->hi;
+
+  w->triples.count = 0;
+  if ( w->DoOnlyPrimitives )
+    w->failed = AddWindowPrimitives<T>( w, lo, hi, 1 );
+  else {
+    const struct wtable<T>* cached = w->cached;
+    long i;
+    for ( i = w->part; i < cached->count && !w->failed; i += w->parts ) {
+      T c = cached->c[i];
+      T k = lo / c + ( lo % c != 0 );
+      T k_max = hi / c;
+      for ( ; k <= k_max && !w->failed; k++ )
+        w->failed = AddWTriple<T>( &w->triples, k * cached->a[i], k * cached->b[i], k * c );
+    }
+
+    T k;
+    T k_max = hi / ( w->cachebound + 1 );
+    for ( k = 1; k <= k_max && !w->failed; k++ ) {
+      T prim_lo = lo / k + ( lo % k != 0 );
+      w->failed = AddWindowPrimitives<T>( w, prim_lo > w->cachebound ? prim_lo : w->cachebound + 1, hi / k, k );
+    }
+  }
+
+  if ( !w->failed )
+    SortWTriples<T>( &w->triples );
+}
+
+// Add this thread's share of k times each primitive triple with c in [c_lo, c_hi].
+template <typename T> int AddWindowPrimitives( struct wwork<T>* w, T c_lo, T c_hi, T k ) {
+
+  if ( w->DoTree ) {
+    // the k come in order from 1, so at most one walk is new
+    if ( (T) w->frontiercount < k ) {
+      struct wfrontier<T>* more = (struct wfrontier<T>*) realloc( w->frontiers, ( w->frontiercount + 1 ) * sizeof(struct wfrontier<T>) );
+      if ( more == NULL )
+        return 1;
+      w->frontiers = more;
+      memset( &w->frontiers[w->frontiercount++], 0, sizeof(struct wfrontier<T>) );
+    }
+    return AddTreePrimitives<T>( &w->triples, &w->frontiers[(long) k - 1], c_lo, c_hi, w->c_max / k, k, w->part, w->parts );
+  }
+  return AddPrimitives<T>( &w->triples, c_lo, c_hi, k, (T) w->part + 1, (T) w->parts, w->spf, w->spfmax );
+}
+
+template <typename T> void* WindowWorker( void* arg ) {
+
+  FillWindow<T>( (struct wwork<T>*) arg );
+  return NULL;
+}
+
+// Add k times each primitive triple with c in [c_lo, c_hi], by Euclid's formula,
+// for n from n_first in steps of n_step.  Returns nonzero if there is no memory for them.
+
+// m - n is odd, so GCD(m,n) = 1 when no odd prime factor of n divides m.  For
+// n up to spfmax, those come from the sieve, and m mod each of them is kept up
+// as m goes up by 2, so there is no dividing in the loop.  Past it, GCD(m,n).
+template <typename T> int AddPrimitives( struct wtable<T>* the_wtable, T c_lo, T c_hi, T k, T n_first, T n_step, const uint32_t* spf, uint32_t spfmax ) {
+
+  if ( c_lo > c_hi || c_hi < 5 )
+    return 0;
+
+  // For each n, m runs from m_lo (the least with m^2 + n^2 >= c_lo) to m_hi
+  // (the most with m^2 + n^2 <= c_hi).  Both only come down as n goes up.
+  T m_hi = WordSqrt<T>( c_hi - 1 );
+  T m_lo = c_lo > 1 ? WordSqrt<T>( c_lo - 2 ) + 1 : 1;  // ceil( (c_lo - 1)^(1/2) )
+  T n_max = WordSqrt<T>( c_hi / 2 );
+  T n;
+  for ( n = n_first; n <= n_max; n += n_step ) {
+    T n_squared = n * n;
+
+    T room = c_hi - n_squared;
+    while ( m_hi * m_hi > room )
+      m_hi--;
+    T need = c_lo > n_squared ? c_lo - n_squared : 0;
+    while ( m_lo > 1 && ( m_lo - 1 ) * ( m_lo - 1 ) >= need )
+      m_lo--;
+
+    // m > n, with m - n odd
+    T m = m_lo > n ? m_lo : n + 1;
+    if ( ( m - n ) % 2 == 0 )
+      m++;
+    if ( m > m_hi )
+      continue;
+
+    // no more than 9 odd primes multiply to under 2^32
+    uint32_t primes[10];
+    uint32_t residues[10];
+    int count = 0;
+    int sieved = n <= (T) spfmax;
+    if ( sieved ) {
+      uint32_t rest = (uint32_t) n;
+      while ( rest > 1 ) {
+        uint32_t p = spf[rest];
+        do
+          rest /= p;
+        while ( rest % p == 0 );
+        if ( p != 2 ) {
+          primes[count] = p;
+          residues[count++] = (uint32_t)( m % p );
+        }
+      }
+    }
+
+    for ( ; m <= m_hi; m += 2 ) {
+
+      // generate a primitive (a,b,c)
+      if ( sieved ) {
+        int coprime = 1;
+        int i;
+        for ( i = 0; i < count; i++ ) {
+          coprime &= residues[i] != 0;
+          residues[i] += 2;
+          if ( residues[i] >= primes[i] )
+            residues[i] -= primes[i];
+        }
+        if ( !coprime )
+          continue;
+      }
+      else if ( WordGCD( (uint64_t) m, (uint64_t) n ) != 1 )
+        continue;
+
+      T m_squared = m * m;
+      if ( AddWTriple<T>( the_wtable, k * ( m_squared - n_squared ), k * 2 * m * n, k * ( m_squared + n_squared ) ) != 0 )
+        return 1;
+    }
+  }
+  return 0;
+}
+
+// Add k times each primitive triple with c in [c_lo, c_hi], from the Berggren
+// tree: (m,n) has children (2m - n, m), (2m + n, m) and (m + 2n, n), from
+// (2,1) at the root.  The walk carries on from the frontier the last call
+// left, whose c_hi was under this c_lo, and leaves its own for the next.
+// Nothing past c_end is ever wanted.  The subtrees some levels down are dealt
+// out in turn to the parts, and this does number part.  Returns nonzero if
+// there is no memory.
+template <typename T> int AddTreePrimitives( struct wtable<T>* the_wtable, struct wfrontier<T>* frontier, T c_lo, T c_hi, T c_end, T k, int part, int parts ) {
+
+  // a few subtrees each, as they are not the same size
+  int split = 0;
+  long subtrees = 1;
+  while ( subtrees < 8L * parts ) {
+    subtrees *= 3;
+    split++;
+  }
+
+  T m_max = WordSqrt<T>( c_end );
+  if ( !frontier->seeded ) {
+    frontier->seeded = 1;
+    if ( c_end < 5 )
+      return 0;
+
+    // The nodes above the split are part 0's, each taken alone.  Those at it
+    // go to the parts in turn, and are taken with all below them.
+    struct wnode<T> stack[64];  // 2 for each level down to the split, and 3 at it
+    long top = 0;
+    stack[top].m = 2;
+    stack[top].n = 1;
+    stack[top++].depth = 0;
+    long subtree = 0;
+    while ( top > 0 ) {
+      struct wnode<T> node = stack[--top];
+      if ( node.depth == split ) {
+        node.c = node.m * node.m + node.n * node.n;
+        if ( subtree++ % parts == part && PushWNode<T>( frontier, node ) != 0 )
+          return 1;
+        continue;
+      }
+      node.c = node.m * node.m + node.n * node.n;
+      if ( part == 0 && PushWNode<T>( frontier, node ) != 0 )
+        return 1;
+
+      T m = node.m;
+      T n = node.n;
+      T children[3][2] = { { 2 * m - n, m }, { 2 * m + n, m }, { m + 2 * n, n } };
+      int i;
+      for ( i = 0; i < 3; i++ ) {
+        T cm = children[i][0];
+        T cn = children[i][1];
+        // c = cm^2 + cn^2 <= c_end, without overflowing
+        if ( cm > m_max || cn * cn > c_end - cm * cm )
+          continue;
+        stack[top].m = cm;
+        stack[top].n = cn;
+        stack[top++].depth = node.depth + 1;
+      }
+    }
+  }
+
+  // Each node the frontier has up to c_hi is taken with all below it up to
+  // c_hi, depth first.  Only the children past c_hi go back on the frontier.
+  long size = 1024;
+  struct wnode<T>* stack = (struct wnode<T>*) malloc( size * sizeof(struct wnode<T>) );
+  if ( stack == NULL )
+    return 1;
+  int failed = 0;
+  while ( frontier->count > 0 && frontier->heap[0].c <= c_hi && !failed ) {
+    long top = 0;
+    stack[top++] = PopWNode<T>( frontier );
+    while ( top > 0 && !failed ) {
+      struct wnode<T> node = stack[--top];
+      T m = node.m;
+      T n = node.n;
+      if ( node.c >= c_lo )
+        failed = AddWTriple<T>( the_wtable, k * ( m * m - n * n ), k * 2 * m * n, k * node.c );
+      if ( node.depth < split )
+        continue;
+
+      // make room for the children
+      if ( top + 3 > size ) {
+        struct wnode<T>* bigger = (struct wnode<T>*) realloc( stack, 2 * size * sizeof(struct wnode<T>) );
+        if ( bigger == NULL ) {
+          failed = 1;
+          break;
+        }
+        stack = bigger;
+        size *= 2;
+      }
+
+      T children[3][2] = { { 2 * m - n, m }, { 2 * m + n, m }, { m + 2 * n, n } };
+      int i;
+      for ( i = 0; i < 3 && !failed; i++ ) {
+        struct wnode<T> child;
+        child.m = children[i][0];
+        child.n = children[i][1];
+        child.depth = split;
+        if ( child.m > m_max || child.n * child.n > c_end - child.m * child.m )
+          continue;
+        child.c = child.m * child.m + child.n * child.n;
+        if ( child.c <= c_hi )
+          stack[top++] = child;
+        else
+          failed = PushWNode<T>( frontier, child );
+      }
+    }
+  }
+
+  free( stack );
+  return failed;
+}
+
+// Add a node to the frontier's heap.  Returns nonzero if there is no memory.
+template <typename T> int PushWNode( struct wfrontier<T>* frontier, struct wnode<T> node ) {
+
+  if ( frontier->count == frontier->size ) {
+    long size = frontier->size == 0 ? 1024 : 2 * frontier->size;
+    struct wnode<T>* bigger = (struct wnode<T>*) realloc( frontier->heap, size * sizeof(struct wnode<T>) );
+    if ( bigger == NULL )
+      return 1;
+    frontier->heap = bigger;
+    frontier->size = size;
+  }
+
+  struct wnode<T>* heap = frontier->heap;
+  long i = frontier->count++;
+  while ( i > 0 && heap[( i - 1 ) / 2].c > node.c ) {
+    heap[i] = heap[( i - 1 ) / 2];
+    i = ( i - 1 ) / 2;
+  }
+  heap[i] = node;
+  return 0;
+}
+
+// Take the node with the least c off the frontier's heap.
+template <typename T> struct wnode<T> PopWNode( struct wfrontier<T>* frontier ) {
+
+  struct wnode<T>* heap = frontier->heap;
+  struct wnode<T> top = heap[0];
+  struct wnode<T> last = heap[--frontier->count];
+  long count = frontier->count;
+  long i = 0;
+  for ( ;; ) {
+    long child = 2 * i + 1;
+    if ( child >= count )
+      break;
+    if ( child + 1 < count && heap[child + 1].c < heap[child].c )
+      child++;
+    if ( heap[child].c >= last.c )
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  if ( count > 0 )
+    heap[i] = last;
+  return top;
+}
+
+template <typename T> void PrintWTriples( const struct wtable<T>* the_wtable ) {
+
+  long i;
+  for ( i = 0; i < the_wtable->count; i++ )
+    PrintWTriple<T>( the_wtable->a[i], the_wtable->b[i], the_wtable->c[i] );
+}
+
+// Print the sorted runs of the threads' work as one, in (c,a) order.
+template <typename T> void MergeWTriples( const struct wwork<T>* work, int runs ) {
+
+  struct wmerge<T> merge;
+  merge.work = work;
+  int heap[MAXTHREADS];
+  int count = 0;
+  int r;
+  for ( r = 0; r < runs; r++ ) {
+    merge.next[r] = 0;
+    if ( work[r].triples.count > 0 )
+      heap[count++] = r;
+  }
+
+  int i;
+  for ( i = count / 2 - 1; i >= 0; i-- )
+    SiftRunDown( heap, count, i, WRunLess<T>, &merge );
+
+  while ( count > 0 ) {
+    r = heap[0];
+    const struct wtable<T>* run = &work[r].triples;
+    long next = merge.next[r];
+    PrintWTriple<T>( run->a[next], run->b[next], run->c[next] );
+    if ( ++merge.next[r] == run->count )
+      heap[0] = heap[--count];
+    SiftRunDown( heap, count, 0, WRunLess<T>, &merge );
+  }
+}
+
+// Whether run r1 is up to an entry before run r2's
+template <typename T> int WRunLess( const void* runs, int r1, int r2 ) {
+
+  const struct wmerge<T>* merge = (const struct wmerge<T>*) runs;
+  const struct wtable<T>* t1 = &merge->work[r1].triples;
+  const struct wtable<T>* t2 = &merge->work[r2].triples;
+  long i1 = merge->next[r1];
+  long i2 = merge->next[r2];
+  return t1->c[i1] < t2->c[i2] || ( t1->c[i1] == t2->c[i2] && t1->a[i1] < t2->a[i2] );
+}
+
+// The text formats: what goes before a, between the numbers, and after c
+const char* const FormatText[3][3] = { { "(", ",", ")\n" }, { "", ",", "\n" }, { "", "\t", "\n" } };
+
+template <typename T> void PrintWTriple( T a, T b, T c ) {
+
+  if ( Output.format == FORMATBIN ) {
+    // a < b < c, so if c fits in 64 bits they all do
+    size_t width = (T)( c >> 32 >> 32 ) == 0 ? 8 : sizeof(T);
+    size_t at = BinRow( width );
+    PutBytes<T>( Output.columns[0] + at, a, width );
+    PutBytes<T>( Output.columns[1] + at, b, width );
+    PutBytes<T>( Output.columns[2] + at, c, width );
+    return;
+  }
+
+  // build the line back to front, then it goes in the buffer in one piece
+  const char* const* text = FormatText[Output.format];
+  char line[3 * 40 + 5];
+  char* end = line + sizeof(line);
+  char* p = end;
+  *--p = '\n';
+  if ( text[2][1] != 0 )
+    *--p = text[2][0];
+  p = WordToStr<T>( c, p );
+  *--p = text[1][0];
+  p = WordToStr<T>( b, p );
+  *--p = text[1][0];
+  p = WordToStr<T>( a, p );
+  if ( text[0][0] != 0 )
+    *--p = text[0][0];
+
+  size_t len = end - p;
+  memcpy( OutputSpace( len ), p, len );
+  Output.count += len;
+}
+
+// Put x at p as width bytes, little endian.
+template <typename T> void PutBytes( unsigned char* p, T x, size_t width ) {
 
+  size_t i;
+  for ( i = 0; i < width && i < sizeof(T); i++ ) {
+    p[i] = (unsigned char) x;
+    x = (T)( x >> 8 );
+  }
+  memset( p + i, 0, width - i );
+}
+
+void PrintPTriple( mpz_t a, mpz_t b, mpz_t c ) {
+
+  if ( Output.format == FORMATBIN ) {
+    // c's bytes, in whole words
+    size_t width = ( mpz_sizeinbase( c, 2 ) + 63 ) / 64 * 8;
+    size_t at = BinRow( width );
+    mpz_ptr z[3] = { a, b, c };
+    int i;
+    for ( i = 0; i < 3; i++ ) {
+      size_t count;
+      mpz_export( Output.columns[i] + at, &count, -1, 1, 0, 0, z[i] );
+      memset( Output.columns[i] + at + count, 0, width - count );
+    }
+    return;
+  }
+
+  const char* const* text = FormatText[Output.format];
+  mpz_ptr z[3] = { a, b, c };
+  int i;
+  for ( i = 0; i < 3; i++ ) {
+    const char* t = text[i == 0 ? 0 : 1];
+    size_t len = strlen( t );
+    char* p = (char*) OutputSpace( len + mpz_sizeinbase( z[i], 10 ) + 2 );
+    memcpy( p, t, len );
+    mpz_get_str( p + len, 10, z[i] );
+    Output.count += len + strlen( p + len );
+  }
+  size_t len = strlen( text[2] );
+  memcpy( OutputSpace( len ), text[2], len );
+  Output.count += len;
+}
+
+// Set up the output for format, and write its header.
+void StartOutput( int format ) {
+
+  Output.format = format;
+  Output.count = 0;
+
+  const char* header = NULL;
+  if ( format == FORMATCSV )
+    header = "a,b,c\n";
+  else if ( format == FORMATTSV )
+    header = "a\tb\tc\n";
+  else if ( format == FORMATBIN ) {
+    unsigned char* p = OutputSpace( 16 );
+    memcpy( p, "ptriples", 8 );
+    PutLE64( p + 8, 2 );  // the version: blocks of columns
+    Output.count += 16;
+  }
+  if ( header != NULL ) {
+    memcpy( OutputSpace( strlen( header ) ), header, strlen( header ) );
+    Output.count += strlen( header );
+  }
+}
+
+// Where in each column of the bin block the next triple goes, each of its
+// numbers as width bytes.  A block holds triples of one width, so one of
+// another width, or one that doesn't fit, starts the next block.
+size_t BinRow( size_t width ) {
+
+  if ( Output.rows > 0 && ( width != Output.width || (size_t)( Output.rows + 1 ) * width > BINBLOCK ) )
+    EndBinBlock();
+  Output.width = width;
+  return Output.rows++ * width;
+}
+
+// Write out the bin block: its count of triples and their width, then its
+// a, b and c columns.
+void EndBinBlock( void ) {
+
+  if ( Output.rows == 0 )
+    return;
+  unsigned char* p = OutputSpace( 16 );
+  PutLE64( p, Output.rows );
+  PutLE64( p + 8, Output.width );
+  Output.count += 16;
+  size_t bytes = Output.rows * Output.width;
+  int i;
+  for ( i = 0; i < 3; i++ ) {
+    memcpy( OutputSpace( bytes ), Output.columns[i], bytes );
+    Output.count += bytes;
+  }
+  Output.rows = 0;
+}
+
+void PutLE64( unsigned char* p, uint64_t x ) {
+
+  int i;
+  for ( i = 0; i < 8; i++ )
+    p[i] = (unsigned char)( x >> ( 8 * i ) );
+}
+
+// Room for size more bytes of output, which the caller adds to Output.count.
+unsigned char* OutputSpace( size_t size ) {
+
+  if ( Output.count + size > OUTPUTBUFFER )
+    WriteOutput();
+  return Output.buffer + Output.count;
+}
+
+void WriteOutput( void ) {
+
+  if ( Output.count > 0 )
+    fwrite( Output.buffer, 1, Output.count, stdout );
+  Output.count = 0;
+}
+
+// Write out everything so far, the bin block being gathered too.
+void FlushOutput( void ) {
+
+  EndBinBlock();
+  WriteOutput();
+  fflush( stdout );
+}
+
+// Add an entry, smaller leg first.  Returns nonzero if there is no memory for it.
+template <typename T> int AddWTriple( struct wtable<T>* the_wtable, T a, T b, T c ) {
+
+  // grow by doubling, so each entry is copied about once however many there are
+  if ( the_wtable->count == the_wtable->size ) {
+    long size = the_wtable->size > 0 ? the_wtable->size * 2 : 1024;
+    T* column;
+    if ( ( column = (T*) realloc( the_wtable->a, sizeof(T) * size ) ) == NULL )
+      return 1;
+    the_wtable->a = column;
+    if ( ( column = (T*) realloc( the_wtable->b, sizeof(T) * size ) ) == NULL )
+      return 1;
+    the_wtable->b = column;
+    if ( ( column = (T*) realloc( the_wtable->c, sizeof(T) * size ) ) == NULL )
+      return 1;
+    the_wtable->c = column;
+    the_wtable->size = size;
+  }
+
+  long i = the_wtable->count++;
+  the_wtable->a[i] = a < b ? a : b;
+  the_wtable->b[i] = a < b ? b : a;
+  the_wtable->c[i] = c;
+  return 0;
+}
+
+#define WLESS( t, i, j )  ( (t)->c[i] < (t)->c[j] || ( (t)->c[i] == (t)->c[j] && (t)->a[i] < (t)->a[j] ) )
+
+#define WSWAP( t, i, j )  do { T s_; \
+  s_ = (t)->a[i];  (t)->a[i] = (t)->a[j];  (t)->a[j] = s_; \
+  s_ = (t)->b[i];  (t)->b[i] = (t)->b[j];  (t)->b[j] = s_; \
+  s_ = (t)->c[i];  (t)->c[i] = (t)->c[j];  (t)->c[j] = s_; } while ( 0 )
+
+// Sort by c, then a, moving the columns together.  It is a quicksort with the
+// compares inline, falling back to a heapsort if the splits go badly.
+template <typename T> void SortWTriples( struct wtable<T>* the_wtable ) {
+
+  int depth = 0;
+  long n;
+  for ( n = the_wtable->count; n > 1; n >>= 1 )
+    depth += 2;
+  SortWRange<T>( the_wtable, 0, the_wtable->count - 1, depth );
+}
+
+// Sort entries lo through hi
+template <typename T> void SortWRange( struct wtable<T>* t, long lo, long hi, int depth ) {
+
+  while ( hi - lo > 16 ) {
+    if ( depth-- == 0 ) {
+      HeapSortWRange<T>( t, lo, hi );
+      return;
+    }
+
+    // median of three, left in the middle
+    long mid = lo + ( hi - lo ) / 2;
+    if ( WLESS( t, mid, lo ) )
+      WSWAP( t, mid, lo );
+    if ( WLESS( t, hi, lo ) )
+      WSWAP( t, hi, lo );
+    if ( WLESS( t, hi, mid ) )
+      WSWAP( t, hi, mid );
+
+    T pc = t->c[mid];
+    T pa = t->a[mid];
+    long i = lo - 1;
+    long j = hi + 1;
+    for ( ;; ) {
+      do i++; while ( t->c[i] < pc || ( t->c[i] == pc && t->a[i] < pa ) );
+      do j--; while ( pc < t->c[j] || ( pc == t->c[j] && pa < t->a[j] ) );
+      if ( i >= j )
+        break;
+      WSWAP( t, i, j );
+    }
+
+    // recurse into the smaller side, so the stack stays shallow
+    if ( j - lo < hi - j ) {
+      SortWRange<T>( t, lo, j, depth );
+      lo = j + 1;
+    }
+    else {
+      SortWRange<T>( t, j + 1, hi, depth );
+      hi = j;
+    }
+  }
+
+  long i;
+  for ( i = lo + 1; i <= hi; i++ ) {
+    T a = t->a[i];
+    T b = t->b[i];
+    T c = t->c[i];
+    long j;
+    for ( j = i; j > lo && ( c < t->c[j - 1] || ( c == t->c[j - 1] && a < t->a[j - 1] ) ); j-- ) {
+      t->a[j] = t->a[j - 1];
+      t->b[j] = t->b[j - 1];
+      t->c[j] = t->c[j - 1];
+    }
+    t->a[j] = a;
+    t->b[j] = b;
+    t->c[j] = c;
+  }
+}
+
+template <typename T> void HeapSortWRange( struct wtable<T>* t, long lo, long hi ) {
+
+  long n = hi - lo + 1;
+  long i;
+  for ( i = n / 2 - 1; i >= 0; i-- )
+    SiftWDown<T>( t, lo, i, n );
+  for ( i = n - 1; i > 0; i-- ) {
+    WSWAP( t, lo, lo + i );
+    SiftWDown<T>( t, lo, 0, i );
+  }
+}
+
+// Move entry lo + r down the heap of n entries from lo
+template <typename T> void SiftWDown( struct wtable<T>* t, long lo, long r, long n ) {
+
+  long child;
+  while ( ( child = 2 * r + 1 ) < n ) {
+    if ( child + 1 < n && WLESS( t, lo + child, lo + child + 1 ) )
+      child++;
+    if ( !WLESS( t, lo + r, lo + child ) )
+      break;
+    WSWAP( t, lo + r, lo + child );
+    r = child;
+  }
+}
+
+#undef WSWAP
+#undef WLESS
+
+template <typename T> void FreeWTable( struct wtable<T>* the_wtable ) {
+
+  free( the_wtable->a );
+  free( the_wtable->b );
+  free( the_wtable->c );
+  memset( the_wtable, 0, sizeof(*the_wtable) );
+}
+
+// Counting needs no triples at all.  Those with c <= N made by Euclid's
+// formula from (m,n), m > n, m - n odd, without the GCD check, number
+// CountEuclidPairs( N ), which is quick to sum up n by n.  Each pair with
+// GCD(m,n) = d (always odd) is d times a primitive pair for c <= N / d^2,
+// so Mobius inversion over odd d gives the primitive count:
+//   P(N) = sum of mu(d) * CountEuclidPairs( N / d^2 )
+// and every triple being k times a primitive one for c <= N / k:
+//   T(N) = sum of P( N / k )
+// where N / k only takes about 2 N^(1/2) values.  That is about N^(1/2) work
+// for P, and N^(3/4) for T, against N for listing them.
+
+// For the histogram, c is the hypotenuse of (prod (2e + 1) - 1) / 2 triples,
+// over the primes p^e dividing it with p = 1 mod 4.  It is the hypotenuse of
+// 2^(w - 1) primitive ones if those are its w prime factors, and none if it
+// has any others.  A sieve factors the c a block at a time.
+
+// Print how many triples have c in [c_min, c_max].
+int CountTriples( uint64_t c_min, uint64_t c_max, int DoOnlyPrimitives ) {
+
+  mpz_t below;
+  mpz_init( below );
+  mpz_t count;
+  mpz_init( count );
+
+  int failed = CountUpTo( below, c_min - 1, DoOnlyPrimitives );
+  if ( !failed )
+    failed = CountUpTo( count, c_max, DoOnlyPrimitives );
+
+  if ( failed )
+    printf("\nNot enough memory.  Aborting.\n\n");
+  else {
+    mpz_sub( count, count, below );
+    gmp_printf("%Zd\n", count );
+  }
+
+  mpz_clear( count );
+  mpz_clear( below );
+  return failed;
+}
+
+// Set count to how many triples have c <= N.  Returns nonzero if there is no memory.
+int CountUpTo( mpz_t count, uint64_t N, int DoOnlyPrimitives ) {
+
+  mpz_set_ui( count, 0 );
+  if ( N < 5 )
+    return 0;
+
+  struct mobius mob;
+  mob.primes = SievePrimes( WordSqrt<uint64_t>( WordSqrt<uint64_t>( N / 5 ) ), &mob.count );
+  mob.mu = (signed char*) malloc( SIEVEBLOCK * sizeof(signed char) );
+  mob.rest = (uint64_t*) malloc( SIEVEBLOCK * sizeof(uint64_t) );
+  int failed = mob.primes == NULL || mob.mu == NULL || mob.rest == NULL;
+
+  if ( !failed ) {
+    if ( DoOnlyPrimitives )
+      mpz_set_ui( count, CountPrimitivesUpTo( &mob, N ) );
+    else {
+      // the k with the same N / k, a run at a time
+      mpz_t part;
+      mpz_init( part );
+      uint64_t k = 1;
+      while ( N / k >= 5 ) {
+        uint64_t v = N / k;
+        uint64_t k_last = N / v;
+        mpz_set_ui( part, CountPrimitivesUpTo( &mob, v ) );
+        mpz_addmul_ui( count, part, k_last - k + 1 );
+        k = k_last + 1;
+      }
+      mpz_clear( part );
+    }
+  }
+
+  free( mob.rest );
+  free( mob.mu );
+  free( mob.primes );
+  return failed;
+}
+
+// How many primitive triples have c <= N.  mob must have the primes up to N^(1/4).
+uint64_t CountPrimitivesUpTo( struct mobius* mob, uint64_t N ) {
+
+  // the sum is done mod 2^64, where the answer fits
+  uint64_t count = 0;
+  uint64_t d_max = WordSqrt<uint64_t>( N / 5 );
+  uint64_t lo;
+  for ( lo = 1; lo <= d_max; lo += SIEVEBLOCK ) {
+    uint64_t hi = d_max - lo < SIEVEBLOCK ? d_max : lo + SIEVEBLOCK - 1;
+    long len = (long)( hi - lo + 1 );
+
+    long i;
+    for ( i = 0; i < len; i++ ) {
+      mob->mu[i] = 1;
+      mob->rest[i] = lo + i;
+    }
+
+    long j;
+    for ( j = 0; j < mob->count && (uint64_t) mob->primes[j] * mob->primes[j] <= hi; j++ ) {
+      uint64_t p = mob->primes[j];
+      for ( i = (long)( ( p - lo % p ) % p ); i < len; i += p ) {
+        mob->mu[i] = -mob->mu[i];
+        mob->rest[i] /= p;
+      }
+      uint64_t pp = p * p;
+      for ( i = (long)( ( pp - lo % pp ) % pp ); i < len; i += pp )
+        mob->mu[i] = 0;
+    }
+
+    // a prime above the root is left over, and only the odd d count
+    for ( i = ( lo % 2 == 0 ); i < len; i += 2 ) {
+      if ( mob->mu[i] == 0 )
+        continue;
+      int mu = mob->rest[i] > 1 ? -mob->mu[i] : mob->mu[i];
+      uint64_t d = lo + i;
+      uint64_t pairs = CountEuclidPairs( N / ( d * d ) );
+      if ( mu > 0 )
+        count += pairs;
+      else
+        count -= pairs;
+    }
+  }
+  return count;
+}
+
+// How many (m,n) have m > n >= 1, m - n odd and m^2 + n^2 <= X.
+uint64_t CountEuclidPairs( uint64_t X ) {
+
+  uint64_t count = 0;
+  uint64_t m = WordSqrt<uint64_t>( X );
+  uint64_t n;
+  for ( n = 1; n * n < X; n++ ) {
+    // the most m, which only comes down as n goes up
+    uint64_t room = X - n * n;
+    while ( m * m > room )
+      m--;
+    if ( m <= n )
+      break;
+    count += ( m - n + 1 ) / 2;  // of n + 1, n + 3, ... m
+  }
+  return count;
+}
+
+// Print each c in [c_min, c_max] that is in any triples, and how many.  The
+// primes up to SIEVEDPRIMES are kept; past that, each block of c values
+// sieves out the primes up to its own root a segment at a time, so memory
+// stays bounded however large c_max is.
+int HistogramTriples( uint64_t c_min, uint64_t c_max, int DoOnlyPrimitives ) {
+
+  uint64_t root = WordSqrt<uint64_t>( c_max );
+  long count = 0;
+  uint32_t* primes = SievePrimes( root < SIEVEDPRIMES ? root : SIEVEDPRIMES, &count );
+  uint64_t* rest = (uint64_t*) malloc( SIEVEBLOCK * sizeof(uint64_t) );
+  uint64_t* triples = (uint64_t*) malloc( SIEVEBLOCK * sizeof(uint64_t) );
+  char* composite = (char*) malloc( SIEVEBLOCK );
+  if ( primes == NULL || rest == NULL || triples == NULL || composite == NULL ) {
+    printf("\nNot enough memory.  Aborting.\n\n");
+    free( composite );
+    free( triples );
+    free( rest );
+    free( primes );
+    return 1;
+  }
+
+  // For all the triples, triples[] builds up prod (2e + 1).  For primitive
+  // ones, it builds up 2^w, and is 0 once c has any other prime factor.
+  uint64_t lo = c_min;
+  for ( ;; ) {
+    uint64_t hi = c_max - lo < SIEVEBLOCK ? c_max : lo + SIEVEBLOCK - 1;
+    long len = (long)( hi - lo + 1 );
+
+    long i;
+    for ( i = 0; i < len; i++ ) {
+      rest[i] = lo + i;
+      triples[i] = 1;
+    }
+
+    long j;
+    for ( j = 0; j < count && (uint64_t) primes[j] * primes[j] <= hi; j++ )
+      SieveOutPrime( primes[j], lo, len, rest, triples, DoOnlyPrimitives );
+
+    // the primes past those kept, up to this block's root
+    uint64_t hiroot = WordSqrt<uint64_t>( hi );
+    uint64_t s;
+    for ( s = SIEVEDPRIMES + 1; s <= hiroot; s += SIEVEBLOCK ) {
+      long slen = hiroot - s < SIEVEBLOCK ? (long)( hiroot - s + 1 ) : SIEVEBLOCK;
+      SieveSegment( s, slen, primes, count, composite );
+      long k;
+      for ( k = 0; k < slen; k++ )
+        if ( !composite[k] )
+          SieveOutPrime( s + k, lo, len, rest, triples, DoOnlyPrimitives );
+    }
+
+    for ( i = 0; i < len; i++ ) {
+      // a prime above the root is left over
+      if ( rest[i] > 1 ) {
+        if ( !DoOnlyPrimitives )
+          triples[i] *= rest[i] % 4 == 1 ? 3 : 1;
+        else
+          triples[i] = rest[i] % 4 == 1 ? 2 * triples[i] : 0;
+      }
+      uint64_t n = triples[i] / 2;  // (prod - 1) / 2, or 2^(w - 1)
+      if ( n == 0 )
+        continue;
+
+      char line[2 * 21 + 2];
+      char* end = line + sizeof(line);
+      char* p = end;
+      *--p = '\n';
+      p = WordToStr<uint64_t>( n, p );
+      *--p = ' ';
+      p = WordToStr<uint64_t>( lo + i, p );
+      memcpy( OutputSpace( end - p ), p, end - p );
+      Output.count += end - p;
+    }
+
+    if ( hi == c_max )
+      break;
+    lo = hi + 1;
+  }
+
+  free( composite );
+  free( triples );
+  free( rest );
+  free( primes );
+  return 0;
+}
+
+// Divide the prime p out of each of the len numbers rest[] left of lo, lo + 1, ...
+// and build up triples[] as HistogramTriples says.
+void SieveOutPrime( uint64_t p, uint64_t lo, long len, uint64_t* rest, uint64_t* triples, int DoOnlyPrimitives ) {
+
+  int good = p % 4 == 1;
+  long i;
+  for ( i = (long)( ( p - lo % p ) % p ); i < len; i += p ) {
+    uint64_t e = 0;
+    do {
+      rest[i] /= p;
+      e++;
+    } while ( rest[i] % p == 0 );
+    if ( !DoOnlyPrimitives ) {
+      if ( good )
+        triples[i] *= 2 * e + 1;
+    }
+    else
+      triples[i] = good ? 2 * triples[i] : 0;
+  }
+}
+
+// The primes up to limit, and how many in count, sieved a block at a time
+// with the primes up to its root.  Returns NULL if there is no memory.
+uint32_t* SievePrimes( uint64_t limit, long* count ) {
+
+  *count = 0;
+  long basecount = 0;
+  uint32_t* base = NULL;
+  if ( limit >= SIEVEBLOCK ) {
+    base = SievePrimes( WordSqrt<uint64_t>( limit ), &basecount );
+    if ( base == NULL )
+      return NULL;
+  }
+
+  char* composite = (char*) malloc( SIEVEBLOCK );
+  long size = 1024;
+  uint32_t* primes = (uint32_t*) malloc( size * sizeof(uint32_t) );
+  if ( composite == NULL || primes == NULL ) {
+    free( primes );
+    free( composite );
+    free( base );
+    return NULL;
+  }
+
+  uint64_t lo;
+  for ( lo = 2; lo <= limit; lo += SIEVEBLOCK ) {
+    long len = limit - lo < SIEVEBLOCK ? (long)( limit - lo + 1 ) : SIEVEBLOCK;
+    if ( base != NULL )
+      SieveSegment( lo, len, base, basecount, composite );
+    else {
+      // small enough to sieve itself, from 2
+      memset( composite, 0, len );
+      long n;
+      for ( n = 2; n * n < len + 2; n++ )
+        if ( !composite[n - 2] ) {
+          long j;
+          for ( j = n * n; j < len + 2; j += n )
+            composite[j - 2] = 1;
+        }
+    }
+
+    long k;
+    for ( k = 0; k < len; k++ )
+      if ( !composite[k] ) {
+        if ( *count == size ) {
+          uint32_t* grown = (uint32_t*) realloc( primes, 2 * size * sizeof(uint32_t) );
+          if ( grown == NULL ) {
+            free( primes );
+            free( composite );
+            free( base );
+            return NULL;
+          }
+          primes = grown;
+          size *= 2;
+        }
+        primes[(*count)++] = (uint32_t)( lo + k );
+      }
+  }
+
+  free( composite );
+  free( base );
+  return primes;
+}
+
+// Mark the composites among the len numbers from lo, given the base primes
+// up to the root of the last.
+void SieveSegment( uint64_t lo, long len, const uint32_t* base, long basecount, char* composite ) {
+
+  memset( composite, 0, len );
+  uint64_t hi = lo + len - 1;
+  long j;
+  for ( j = 0; j < basecount && (uint64_t) base[j] * base[j] <= hi; j++ ) {
+    uint64_t p = base[j];
+    uint64_t first = p * p >= lo ? p * p : lo + ( p - lo % p ) % p;
+    uint64_t n;
+    for ( n = first; n <= hi; n += p )
+      composite[n - lo] = 1;
+  }
+}
+
+// The smallest prime factor of each number up to limit.  Returns NULL if there is no memory.
+uint32_t* SieveFactors( uint32_t limit ) {
+
+  uint32_t* spf = (uint32_t*) calloc( (size_t) limit + 1, sizeof(uint32_t) );
+  if ( spf == NULL )
+    return NULL;
+
+  uint64_t n;
+  for ( n = 2; n <= limit; n++ )
+    if ( spf[n] == 0 ) {
+      spf[n] = (uint32_t) n;
+      uint64_t j;
+      for ( j = n * n; j <= limit; j += n )
+        if ( spf[j] == 0 )
+          spf[j] = (uint32_t) n;
+    }
+  return spf;
+}
+
+// The value of a non-negative z that fits in a T.
+template <typename T> T MpzToWord( mpz_t z ) {
+
+  unsigned char bytes[sizeof(T)];
+  size_t count = 0;
+  mpz_export( bytes, &count, -1, 1, 0, 0, z );
+
+  T w = 0;
+  while ( count > 0 )
+    w = ( w << 8 ) | bytes[--count];
+  return w;
+}
+
+// floor( x^(1/2) )
+template <typename T> T WordSqrt( T x ) {
+
+  if ( x < 2 )
+    return x;
+
+  // start from a power of 2 above the root, and Newton's method comes down to it
+  T r = 2;
+  T y = x;
+  while ( y >= 4 ) {
+    y >>= 2;
+    r <<= 1;
+  }
+  for ( ;; ) {
+    T next = ( r + x / r ) / 2;
+    if ( next >= r )
+      return r;
+    r = next;
+  }
+}
+
+const uint64_t Pow10_19 = 10000000000000000000ULL;
+
+// "00" through "99", for two digits at a time
+const char DigitPairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+// Write the digits of x ending just before end.  Returns where they start.
+template <typename T> char* WordToStr( T x, char* end ) {
+
+  // past 64 bits, 19 digits at a time
+  char* p = end;
+  while ( (T)( x >> 32 >> 32 ) != 0 ) {
+    char* start = p - 19;
+    p = U64ToStr( (uint64_t)( x % (T) Pow10_19 ), p );
+    while ( p > start )
+      *--p = '0';
+    x /= (T) Pow10_19;
+  }
+  return U64ToStr( (uint64_t) x, p );
+}
+
+char* U64ToStr( uint64_t x, char* end ) {
+
+  char* p = end;
+  while ( x >= 100 ) {
+    const char* pair = DigitPairs + 2 * ( x % 100 );
+    x /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if ( x >= 10 ) {
+    *--p = DigitPairs[2 * x + 1];
+    *--p = DigitPairs[2 * x];
+  }
+  else
+    *--p = (char)( '0' + x );
+  return p;
+}
+
+uint64_t WordGCD( uint64_t u, uint64_t v ) {
+
+  while ( v != 0 ) {
+    uint64_t t = u % v;
+    u = v;
+    v = t;
+  }
+  return u;
+}